@@ -0,0 +1,839 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * acer-wmi-ext-test.c: KUnit tests for the Acer WMI extension driver
+ *
+ * Included at the end of acer-wmi-ext.c when the driver is built with
+ * ACER_WMI_EXT_KUNIT, so that the tests can reach its static
+ * functions. Every test runs against the mock backend, which is
+ * swapped in for the duration of the test, and a freshly reset
+ * emulated firmware.
+ */
+
+#ifndef ACER_WMI_EXT_MOCK
+#error "The KUnit tests need the mock backend (ACER_WMI_EXT_MOCK)"
+#endif
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+
+struct acer_test_saved {
+	const struct acer_fw_backend *fw;
+	struct quirk_entry *quirks;
+	bool stale_while_revalidate;
+	int control_mode_inited;
+	unsigned int fw_timeout_ms;
+	short enable_health_mode;
+	short enable_system_control_mode;
+	unsigned int nr_batteries;
+};
+
+static struct acer_test_saved acer_test_saved;
+
+static void acer_test_reset_firmware(void)
+{
+	mutex_lock(&acer_mock_lock);
+	memset(acer_mock.ec, 0, sizeof(acer_mock.ec));
+	acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET] = SYSTEM_CONTROL_BALANCED;
+	acer_mock.battery_functions = HEALTH_MODE | CALIBRATION_MODE;
+	memset(acer_mock.battery_status, 0, sizeof(acer_mock.battery_status));
+	acer_mock.usb_charge = usb_charge_encode(true, ACER_USB_CHARGE_LIMIT_DEFAULT) &
+			       ~ACER_USB_CHARGE_FUNCTION_MASK;
+	acer_mock.latency_us = 0;
+	acer_mock.fail_ops = 0;
+	mutex_unlock(&acer_mock_lock);
+
+	spin_lock(&acer_fw_breaker_lock);
+	memset(acer_fw_breakers, 0, sizeof(acer_fw_breakers));
+	spin_unlock(&acer_fw_breaker_lock);
+
+	acer_cache_invalidate_all();
+	acer_ec_shadow_invalidate_all();
+}
+
+static int acer_test_init(struct kunit *test)
+{
+	acer_test_saved.fw = acer_fw;
+	acer_test_saved.quirks = quirks;
+	acer_test_saved.stale_while_revalidate = cache_stale_while_revalidate;
+	acer_test_saved.control_mode_inited = system_control_mode_inited;
+	acer_test_saved.fw_timeout_ms = fw_timeout_ms;
+	acer_test_saved.enable_health_mode = enable_health_mode;
+	acer_test_saved.enable_system_control_mode = enable_system_control_mode;
+	acer_test_saved.nr_batteries = acer_nr_batteries;
+
+	acer_fw = &acer_fw_backend_mock;
+	quirks = &quirk_acer_sfg174_73;
+	cache_stale_while_revalidate = false;
+	acer_test_reset_firmware();
+
+	/* Start from the state of the emulated firmware */
+	KUNIT_ASSERT_EQ(test, init_state(), AE_OK);
+	KUNIT_ASSERT_EQ(test, acer_cache_refresh(ACER_CACHE_USB_CHARGE), 0);
+	/* Also when the driver itself found no control mode, e.g. built in
+	   on a machine that does not match a quirk */
+	KUNIT_ASSERT_EQ(test, acer_system_control_mode_init(), 0);
+
+	return 0;
+}
+
+static void acer_test_exit(struct kunit *test)
+{
+	WRITE_ONCE(acer_mock.fail_ops, 0);
+	WRITE_ONCE(acer_mock.latency_us, 0);
+	/* Let refreshes and writes a test gave up on finish on the mock */
+	flush_workqueue(acer_cache_wq);
+	flush_work(&acer_cmd_work);
+
+	acer_fw = acer_test_saved.fw;
+	quirks = acer_test_saved.quirks;
+	cache_stale_while_revalidate = acer_test_saved.stale_while_revalidate;
+	system_control_mode_inited = acer_test_saved.control_mode_inited;
+	fw_timeout_ms = acer_test_saved.fw_timeout_ms;
+	enable_health_mode = acer_test_saved.enable_health_mode;
+	enable_system_control_mode = acer_test_saved.enable_system_control_mode;
+	/* init_state() looked for batteries on the reset firmware */
+	acer_nr_batteries = acer_test_saved.nr_batteries;
+
+	/* Nothing read from the mock may be taken for the real firmware */
+	acer_cache_invalidate_all();
+	acer_ec_shadow_invalidate_all();
+}
+
+static ssize_t acer_test_store(struct device_attribute *attr, const char *val)
+{
+	return attr->store(NULL, attr, val, strlen(val));
+}
+
+static void acer_test_expect_show(struct kunit *test,
+				  struct device_attribute *attr,
+				  const char *expected)
+{
+	char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	ssize_t len;
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	len = attr->show(NULL, attr, buf);
+	KUNIT_EXPECT_GT(test, len, 0);
+	KUNIT_EXPECT_STREQ(test, buf, expected);
+}
+
+static void acer_test_health_mode(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_health_mode, "1"), 1);
+	KUNIT_EXPECT_EQ(test, acer_mock.battery_status[0][0], 1);
+	acer_test_expect_show(test, &dev_attr_health_mode, "1\n");
+
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_health_mode, "0"), 1);
+	KUNIT_EXPECT_EQ(test, acer_mock.battery_status[0][0], 0);
+	acer_test_expect_show(test, &dev_attr_health_mode, "0\n");
+}
+
+static void acer_test_calibration_mode(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_calibration_mode, "1"), 1);
+	KUNIT_EXPECT_EQ(test, acer_mock.battery_status[0][1], 1);
+	acer_test_expect_show(test, &dev_attr_calibration_mode, "1\n");
+
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_calibration_mode, "0"), 1);
+	KUNIT_EXPECT_EQ(test, acer_mock.battery_status[0][1], 0);
+	acer_test_expect_show(test, &dev_attr_calibration_mode, "0\n");
+}
+
+static void acer_test_system_control_mode(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_system_control_mode, "3"), 1);
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			SYSTEM_CONTROL_PERFORMANCE);
+	acer_test_expect_show(test, &dev_attr_system_control_mode, "3\n");
+
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_system_control_mode, "2"), 1);
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			SYSTEM_CONTROL_SILENT);
+	acer_test_expect_show(test, &dev_attr_system_control_mode, "2\n");
+
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_system_control_mode, "4"),
+			-EINVAL);
+}
+
+static void acer_test_usb_charge_mode(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_usb_charge_mode, "0"), 1);
+	KUNIT_EXPECT_EQ(test, usb_charge_decode(acer_mock.usb_charge).enable, 0);
+	acer_test_expect_show(test, &dev_attr_usb_charge_mode, "0\n");
+	acer_test_expect_show(test, &dev_attr_usb_charge_limit, "-1\n");
+
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_usb_charge_mode, "1"), 1);
+	KUNIT_EXPECT_EQ(test, usb_charge_decode(acer_mock.usb_charge).enable, 1);
+	acer_test_expect_show(test, &dev_attr_usb_charge_mode, "1\n");
+}
+
+static void acer_test_usb_charge_limit(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_usb_charge_limit, "20"), 2);
+	KUNIT_EXPECT_EQ(test, usb_charge_decode(acer_mock.usb_charge).limit, 20);
+	acer_test_expect_show(test, &dev_attr_usb_charge_limit, "20\n");
+
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_usb_charge_limit, "25"),
+			-EINVAL);
+	acer_test_expect_show(test, &dev_attr_usb_charge_limit, "20\n");
+}
+
+/*
+ * A second battery is only found when its reply differs from battery
+ * 1's; firmware that ignores uBatteryNo would answer with the same one.
+ */
+static void acer_test_battery_discover(struct kunit *test)
+{
+	unsigned int saved_mock_batteries = mock_batteries;
+
+	mock_batteries = 2;
+
+	acer_mock.battery_status[1][0] = 1;
+	acer_battery_discover();
+	KUNIT_EXPECT_EQ(test, acer_nr_batteries, 2);
+
+	acer_mock.battery_status[1][0] = acer_mock.battery_status[0][0];
+	acer_mock.battery_status[1][1] = acer_mock.battery_status[0][1];
+	acer_battery_discover();
+	KUNIT_EXPECT_EQ(test, acer_nr_batteries, 1);
+
+	mock_batteries = 1;
+	acer_battery_discover();
+	KUNIT_EXPECT_EQ(test, acer_nr_batteries, 1);
+
+	mock_batteries = saved_mock_batteries;
+}
+
+/*
+ * Failure injection: every attribute access that reaches the firmware
+ * returns an error when its operation fails, and a failed store leaves
+ * the emulated firmware as it was.
+ */
+struct acer_test_failure {
+	const char *name;
+	struct device_attribute *attr;
+	enum acer_fw_op op;
+	const char *store;	/* NULL to fail a show */
+};
+
+static const struct acer_test_failure acer_test_failures[] = {
+	{ "health_mode show", &dev_attr_health_mode,
+	  ACER_FW_OP_BATTERY_STATUS_GET },
+	{ "health_mode store", &dev_attr_health_mode,
+	  ACER_FW_OP_BATTERY_CONTROL_SET, "1" },
+	{ "calibration_mode show", &dev_attr_calibration_mode,
+	  ACER_FW_OP_BATTERY_STATUS_GET },
+	{ "calibration_mode store", &dev_attr_calibration_mode,
+	  ACER_FW_OP_BATTERY_CONTROL_SET, "1" },
+	{ "system_control_mode show", &dev_attr_system_control_mode,
+	  ACER_FW_OP_EC_READ },
+	{ "system_control_mode store", &dev_attr_system_control_mode,
+	  ACER_FW_OP_EC_WRITE, "3" },
+	{ "usb_charge_mode show", &dev_attr_usb_charge_mode,
+	  ACER_FW_OP_APGEACTION_GET },
+	{ "usb_charge_mode store", &dev_attr_usb_charge_mode,
+	  ACER_FW_OP_APGEACTION_SET, "0" },
+	{ "usb_charge_limit show", &dev_attr_usb_charge_limit,
+	  ACER_FW_OP_APGEACTION_GET },
+	{ "usb_charge_limit store", &dev_attr_usb_charge_limit,
+	  ACER_FW_OP_APGEACTION_SET, "20" },
+};
+
+static void acer_test_failure_desc(const struct acer_test_failure *failure,
+				   char *desc)
+{
+	strscpy(desc, failure->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(acer_test_failure, acer_test_failures, acer_test_failure_desc);
+
+static void acer_test_fail_ops(struct kunit *test)
+{
+	const struct acer_test_failure *failure = test->param_value;
+	u8 battery_status[ACER_MAX_BATTERIES][2];
+	char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	u64 usb_charge;
+	u8 mode;
+	ssize_t ret;
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	memcpy(battery_status, acer_mock.battery_status, sizeof(battery_status));
+	usb_charge = acer_mock.usb_charge;
+	mode = acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET];
+
+	/* Make the access go to the firmware */
+	acer_cache_invalidate_all();
+	acer_ec_shadow_invalidate_all();
+	WRITE_ONCE(acer_mock.fail_ops, BIT(failure->op));
+
+	if (failure->store)
+		ret = acer_test_store(failure->attr, failure->store);
+	else
+		ret = failure->attr->show(NULL, failure->attr, buf);
+	KUNIT_EXPECT_LT(test, ret, 0);
+
+	WRITE_ONCE(acer_mock.fail_ops, 0);
+	KUNIT_EXPECT_EQ(test, memcmp(battery_status, acer_mock.battery_status,
+				     sizeof(battery_status)), 0);
+	KUNIT_EXPECT_EQ(test, acer_mock.usb_charge, usb_charge);
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			mode);
+}
+
+/* Sensor reads that keep failing do not hold back control mode reads */
+static void acer_test_sensor_breaker(struct kunit *test)
+{
+	const u8 offsets[] = { 0x13, 0x14, 0xb0 };
+	u8 values[ARRAY_SIZE(offsets)];
+	int err;
+
+	WRITE_ONCE(acer_mock.fail_ops, BIT(ACER_FW_OP_EC_SENSOR_READ));
+	for (int i = 0; i < ACER_FW_BREAKER_THRESHOLD; i++)
+		KUNIT_EXPECT_EQ(test, acer_ec_read_burst(offsets, values,
+							 ARRAY_SIZE(offsets)),
+				-EIO);
+	KUNIT_EXPECT_FALSE(test,
+			   acer_fw_breaker_allow(ACER_FW_OP_EC_SENSOR_READ, &err));
+	WRITE_ONCE(acer_mock.fail_ops, 0);
+
+	KUNIT_EXPECT_TRUE(test, acer_fw_breaker_allow(ACER_FW_OP_EC_READ, &err));
+	acer_ec_shadow_invalidate_all();
+	acer_test_expect_show(test, &dev_attr_system_control_mode, "1\n");
+}
+
+static void acer_test_platform_profile(struct kunit *test)
+{
+	enum platform_profile_option profile;
+
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_get(NULL, &profile), 0);
+	KUNIT_EXPECT_EQ(test, profile, PLATFORM_PROFILE_BALANCED);
+
+	/* Profile switches are queued without waiting */
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_set(NULL,
+					PLATFORM_PROFILE_PERFORMANCE), 0);
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_get(NULL, &profile), 0);
+	KUNIT_EXPECT_EQ(test, profile, PLATFORM_PROFILE_PERFORMANCE);
+	flush_work(&acer_cmd_work);
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			SYSTEM_CONTROL_PERFORMANCE);
+
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_set(NULL,
+					PLATFORM_PROFILE_LOW_POWER), 0);
+	flush_work(&acer_cmd_work);
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			SYSTEM_CONTROL_SILENT);
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_get(NULL, &profile), 0);
+	KUNIT_EXPECT_EQ(test, profile, PLATFORM_PROFILE_LOW_POWER);
+
+	/* A rejected write is not kept as the current profile */
+	WRITE_ONCE(acer_mock.fail_ops, BIT(ACER_FW_OP_EC_WRITE));
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_set(NULL,
+					PLATFORM_PROFILE_BALANCED), 0);
+	flush_work(&acer_cmd_work);
+	WRITE_ONCE(acer_mock.fail_ops, 0);
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_get(NULL, &profile), 0);
+	KUNIT_EXPECT_EQ(test, profile, PLATFORM_PROFILE_LOW_POWER);
+
+	KUNIT_EXPECT_EQ(test, acer_platform_profile_set(NULL,
+					PLATFORM_PROFILE_COOL), -EOPNOTSUPP);
+}
+
+#ifdef CONFIG_PM_SLEEP
+/*
+ * The reconciliation after resume restores what the firmware reset,
+ * but not what was written between resume and the reconciliation.
+ */
+static void acer_test_resume_reconcile(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_system_control_mode, "3"), 1);
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_usb_charge_limit, "20"), 2);
+	KUNIT_EXPECT_EQ(test, acer_ext_suspend(NULL), 0);
+
+	/* The firmware resets both settings while suspended */
+	mutex_lock(&acer_mock_lock);
+	acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET] = SYSTEM_CONTROL_BALANCED;
+	acer_mock.usb_charge = usb_charge_encode(true, ACER_USB_CHARGE_LIMIT_DEFAULT) &
+			       ~ACER_USB_CHARGE_FUNCTION_MASK;
+	mutex_unlock(&acer_mock_lock);
+
+	/* What acer_ext_resume() does, without queueing the work item */
+	acer_ec_shadow_invalidate_all();
+	acer_cache_invalidate_all();
+	acer_resume_ticket = acer_cmd_ticket();
+
+	/* The user picks a profile before the reconciliation runs */
+	KUNIT_EXPECT_EQ(test, acer_test_store(&dev_attr_system_control_mode, "2"), 1);
+	acer_ext_reconcile(NULL);
+
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			SYSTEM_CONTROL_SILENT);
+	KUNIT_EXPECT_EQ(test, usb_charge_decode(acer_mock.usb_charge).limit, 20);
+	KUNIT_EXPECT_EQ(test, acer_pm_stats.reconcile_writes, 1);
+	KUNIT_EXPECT_EQ(test, acer_pm_stats.reconcile_skipped, 1);
+}
+#endif
+
+/*
+ * Init paths. They are run again on the mock, so the timings of the
+ * actual load are kept aside and restored.
+ */
+static typeof(acer_init_phases) acer_test_init_phases;
+
+static void acer_test_init_report(struct kunit *test)
+{
+	for (int phase = ACER_INIT_BATTERY; phase <= ACER_INIT_PARAMS; phase++)
+		kunit_info(test, "init %s: %llu us, result %d\n",
+			   acer_init_phase_names[phase],
+			   div_u64(acer_init_phases[phase].duration_ns,
+				   NSEC_PER_USEC),
+			   acer_init_phases[phase].result);
+}
+
+static void acer_test_init_paths(struct kunit *test)
+{
+	memcpy(&acer_test_init_phases, acer_init_phases,
+	       sizeof(acer_init_phases));
+
+	mutex_lock(&acer_mock_lock);
+	acer_mock.battery_status[0][0] = 1;
+	acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET] = SYSTEM_CONTROL_SILENT;
+	mutex_unlock(&acer_mock_lock);
+	acer_ec_shadow_invalidate_all();
+
+	/* The probes only read */
+	enable_health_mode = 0;
+	enable_system_control_mode = SYSTEM_CONTROL_PERFORMANCE;
+	KUNIT_EXPECT_EQ(test, acer_init_probes(), 0);
+	KUNIT_EXPECT_EQ(test, acer_mock.battery_status[0][0], 1);
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			SYSTEM_CONTROL_SILENT);
+
+	/* The parameters are written afterwards */
+	KUNIT_EXPECT_EQ(test, acer_init_params(), 0);
+	KUNIT_EXPECT_EQ(test, acer_mock.battery_status[0][0], 0);
+	KUNIT_EXPECT_EQ(test, acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET],
+			SYSTEM_CONTROL_PERFORMANCE);
+	acer_test_init_report(test);
+
+	/* A failed battery probe fails the load */
+	acer_cache_invalidate_all();
+	WRITE_ONCE(acer_mock.fail_ops, BIT(ACER_FW_OP_BATTERY_STATUS_GET));
+	KUNIT_EXPECT_EQ(test, acer_init_probes(), -EIO);
+	WRITE_ONCE(acer_mock.fail_ops, 0);
+
+	memcpy(acer_init_phases, &acer_test_init_phases,
+	       sizeof(acer_init_phases));
+}
+
+/* With every firmware call delayed, the probes still only cost the slowest */
+static void acer_test_init_latency(struct kunit *test)
+{
+	u64 sum = 0;
+
+	memcpy(&acer_test_init_phases, acer_init_phases,
+	       sizeof(acer_init_phases));
+
+	acer_cache_invalidate_all();
+	acer_ec_shadow_invalidate_all();
+	WRITE_ONCE(acer_mock.latency_us, 20000);
+	KUNIT_EXPECT_EQ(test, acer_init_probes(), 0);
+	WRITE_ONCE(acer_mock.latency_us, 0);
+
+	for (int phase = ACER_INIT_BATTERY; phase <= ACER_INIT_USB_CHARGE; phase++)
+		sum += acer_init_phases[phase].duration_ns;
+	KUNIT_EXPECT_LT(test, acer_init_phases[ACER_INIT_PROBES].duration_ns, sum);
+	acer_test_init_report(test);
+	kunit_info(test, "init probes: %llu us, sum of the probes %llu us\n",
+		   div_u64(acer_init_phases[ACER_INIT_PROBES].duration_ns,
+			   NSEC_PER_USEC),
+		   div_u64(sum, NSEC_PER_USEC));
+
+	memcpy(acer_init_phases, &acer_test_init_phases,
+	       sizeof(acer_init_phases));
+}
+
+/* A reader gives up after fw_timeout_ms even if the firmware hangs */
+static void acer_test_latency_timeout(struct kunit *test)
+{
+	char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	u64 start, elapsed;
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	fw_timeout_ms = 20;
+	acer_cache_invalidate_all();
+	WRITE_ONCE(acer_mock.latency_us, 200000);
+
+	start = ktime_get_ns();
+	KUNIT_EXPECT_EQ(test, dev_attr_health_mode.show(NULL, &dev_attr_health_mode,
+							buf), -ETIMEDOUT);
+	elapsed = ktime_get_ns() - start;
+	KUNIT_EXPECT_LT(test, elapsed, 150 * NSEC_PER_MSEC);
+	kunit_info(test, "health_mode show with a hung firmware: %llu us\n",
+		   div_u64(elapsed, NSEC_PER_USEC));
+}
+
+/*
+ * Timing of every path, without and with an injected firmware latency.
+ * Shows within cache_ttl_ms are served from the state; stores always
+ * reach the emulated firmware.
+ */
+#define ACER_TEST_TIMING_ITERATIONS	20
+
+static const struct {
+	const char *name;
+	struct device_attribute *attr;
+	const char *store;	/* NULL for a show */
+} acer_test_paths[] = {
+	{ "health_mode show", &dev_attr_health_mode },
+	{ "health_mode store", &dev_attr_health_mode, "1" },
+	{ "calibration_mode show", &dev_attr_calibration_mode },
+	{ "calibration_mode store", &dev_attr_calibration_mode, "0" },
+	{ "system_control_mode show", &dev_attr_system_control_mode },
+	{ "system_control_mode store", &dev_attr_system_control_mode, "3" },
+	{ "usb_charge_mode show", &dev_attr_usb_charge_mode },
+	{ "usb_charge_mode store", &dev_attr_usb_charge_mode, "1" },
+	{ "usb_charge_limit show", &dev_attr_usb_charge_limit },
+	{ "usb_charge_limit store", &dev_attr_usb_charge_limit, "20" },
+	{ "calibration_phase show", &dev_attr_calibration_phase },
+	{ "calibration_progress show", &dev_attr_calibration_progress },
+};
+
+static const u32 acer_test_latencies_us[] = { 0, 500 };
+
+static void acer_test_latency_desc(const u32 *latency_us, char *desc)
+{
+	snprintf(desc, KUNIT_PARAM_DESC_SIZE, "latency_us=%u", *latency_us);
+}
+
+KUNIT_ARRAY_PARAM(acer_test_latency, acer_test_latencies_us,
+		  acer_test_latency_desc);
+
+static void acer_test_timing(struct kunit *test)
+{
+	static const enum platform_profile_option profiles[] = {
+		PLATFORM_PROFILE_PERFORMANCE, PLATFORM_PROFILE_BALANCED,
+	};
+	const u32 *latency_us = test->param_value;
+	char *buf = kunit_kzalloc(test, PAGE_SIZE, GFP_KERNEL);
+	enum platform_profile_option profile;
+	ssize_t ret;
+	u64 start;
+	int i;
+
+	KUNIT_ASSERT_NOT_NULL(test, buf);
+	WRITE_ONCE(acer_mock.latency_us, *latency_us);
+
+	for (int path = 0; path < ARRAY_SIZE(acer_test_paths); path++) {
+		struct device_attribute *attr = acer_test_paths[path].attr;
+
+		start = ktime_get_ns();
+		for (i = 0; i < ACER_TEST_TIMING_ITERATIONS; i++) {
+			if (acer_test_paths[path].store)
+				ret = acer_test_store(attr,
+						      acer_test_paths[path].store);
+			else
+				ret = attr->show(NULL, attr, buf);
+			KUNIT_EXPECT_GT(test, ret, 0);
+		}
+		kunit_info(test, "%s: %llu ns per call\n",
+			   acer_test_paths[path].name,
+			   div_u64(ktime_get_ns() - start,
+				   ACER_TEST_TIMING_ITERATIONS));
+	}
+
+	start = ktime_get_ns();
+	for (i = 0; i < ACER_TEST_TIMING_ITERATIONS; i++)
+		KUNIT_EXPECT_EQ(test, acer_platform_profile_get(NULL, &profile), 0);
+	kunit_info(test, "platform_profile get: %llu ns per call\n",
+		   div_u64(ktime_get_ns() - start, ACER_TEST_TIMING_ITERATIONS));
+
+	/* Until the mode is in the EC, not only until it is queued */
+	start = ktime_get_ns();
+	for (i = 0; i < ACER_TEST_TIMING_ITERATIONS; i++) {
+		KUNIT_EXPECT_EQ(test, acer_platform_profile_set(NULL,
+						profiles[i % 2]), 0);
+		flush_work(&acer_cmd_work);
+	}
+	kunit_info(test, "platform_profile set: %llu ns per call\n",
+		   div_u64(ktime_get_ns() - start, ACER_TEST_TIMING_ITERATIONS));
+}
+
+/*
+ * acer_state is read without locks from many contexts while refreshes
+ * and the calibration tracking write it. Readers running against
+ * writers must never see a group of fields half updated: the USB
+ * charging word and its enable flag, or the calibration phase and its
+ * progress, which the writers below always keep at phase * 33.
+ * The time every read takes is measured as well, to show that it does
+ * not grow while the writers run.
+ */
+#define ACER_TEST_STATE_READERS	4
+#define ACER_TEST_STATE_MS	200
+
+static bool acer_test_state_consistent(const struct acer_state *state)
+{
+	return state->usb_charge_mode_enable ==
+		       usb_charge_decode(state->usb_charge_status).enable &&
+	       state->calibration_progress == state->calibration_phase * 33;
+}
+
+/* Written by the reader thread, read once it has been stopped */
+struct acer_test_reader {
+	struct task_struct *task;
+	u64 reads;
+	u64 total_ns;
+	u64 max_ns;
+	unsigned int torn;
+};
+
+static int acer_test_state_reader(void *data)
+{
+	struct acer_test_reader *reader = data;
+	struct acer_state state;
+	u64 start, ns;
+
+	while (!kthread_should_stop()) {
+		start = ktime_get_ns();
+		acer_state_get(&state);
+		ns = ktime_get_ns() - start;
+
+		if (!acer_test_state_consistent(&state))
+			reader->torn++;
+		reader->reads++;
+		reader->total_ns += ns;
+		reader->max_ns = max(reader->max_ns, ns);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int acer_test_usb_charge_writer(void *data)
+{
+	static const u8 limits[] = { 10, 20, 30 };
+	unsigned int i = 0;
+	bool enable;
+
+	while (!kthread_should_stop()) {
+		enable = i % 4 != 3;
+		acer_state_set_usb_charge(usb_charge_encode(enable,
+				enable ? limits[i % 3] : ACER_USB_CHARGE_LIMIT_OFF),
+				enable);
+		i++;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int acer_test_calibration_writer(void *data)
+{
+	unsigned int i = 0;
+	u8 phase;
+
+	while (!kthread_should_stop()) {
+		phase = i++ % (ACER_CALIB_RECHARGING + 1);
+		acer_state_set_calibration(phase, phase * 33);
+		cond_resched();
+	}
+
+	return 0;
+}
+
+struct acer_test_state_result {
+	u64 reads;
+	u64 mean_ns;
+	u64 max_ns;
+	unsigned int torn;
+};
+
+static int acer_test_state_start(struct task_struct **task,
+				 int (*fn)(void *), void *data,
+				 const char *name, int i)
+{
+	*task = kthread_run(fn, data, "%s/%d", name, i);
+	if (IS_ERR(*task)) {
+		int err = PTR_ERR(*task);
+
+		*task = NULL;
+		return err;
+	}
+	return 0;
+}
+
+/* Run the readers for ACER_TEST_STATE_MS, with the writers if asked to */
+static int acer_test_state_run(bool with_writers,
+			       struct acer_test_state_result *result)
+{
+	struct acer_test_reader readers[ACER_TEST_STATE_READERS] = { 0 };
+	struct task_struct *writers[2] = { NULL };
+	u64 total_ns = 0;
+	int err = 0;
+	int i;
+
+	for (i = 0; i < ACER_TEST_STATE_READERS && !err; i++)
+		err = acer_test_state_start(&readers[i].task,
+					    acer_test_state_reader, &readers[i],
+					    "acer_test_rd", i);
+	if (with_writers && !err)
+		err = acer_test_state_start(&writers[0],
+					    acer_test_usb_charge_writer, NULL,
+					    "acer_test_wr", 0);
+	if (with_writers && !err)
+		err = acer_test_state_start(&writers[1],
+					    acer_test_calibration_writer, NULL,
+					    "acer_test_wr", 1);
+
+	if (!err)
+		msleep(ACER_TEST_STATE_MS);
+
+	for (i = 0; i < ARRAY_SIZE(writers); i++)
+		if (writers[i])
+			kthread_stop(writers[i]);
+
+	memset(result, 0, sizeof(*result));
+	for (i = 0; i < ACER_TEST_STATE_READERS; i++) {
+		if (!readers[i].task)
+			continue;
+		kthread_stop(readers[i].task);
+		result->reads += readers[i].reads;
+		result->torn += readers[i].torn;
+		result->max_ns = max(result->max_ns, readers[i].max_ns);
+		total_ns += readers[i].total_ns;
+	}
+	result->mean_ns = div64_u64(total_ns, max_t(u64, result->reads, 1));
+
+	return err;
+}
+
+static void acer_test_state_torn(struct kunit *test)
+{
+	struct acer_test_state_result idle, busy;
+	struct acer_state saved;
+	int err;
+
+	/* Put back every field the writers touch once done */
+	acer_state_get(&saved);
+	acer_state_set_calibration(ACER_CALIB_IDLE, 0);
+
+	err = acer_test_state_run(false, &idle);
+	if (!err)
+		err = acer_test_state_run(true, &busy);
+
+	acer_state_set_usb_charge(saved.usb_charge_status,
+				  saved.usb_charge_mode_enable);
+	acer_state_set_calibration(saved.calibration_phase,
+				   saved.calibration_progress);
+
+	KUNIT_ASSERT_EQ(test, err, 0);
+	kunit_info(test, "acer_state_get without writers: %llu reads, mean %llu ns, max %llu ns\n",
+		   idle.reads, idle.mean_ns, idle.max_ns);
+	kunit_info(test, "acer_state_get with writers: %llu reads, mean %llu ns, max %llu ns\n",
+		   busy.reads, busy.mean_ns, busy.max_ns);
+
+	KUNIT_EXPECT_GT(test, idle.reads, 0);
+	KUNIT_EXPECT_GT(test, busy.reads, 0);
+	KUNIT_EXPECT_EQ(test, idle.torn, 0);
+	KUNIT_EXPECT_EQ(test, busy.torn, 0);
+	/* Readers retry at most for the few stores of a writer; a reader
+	   that waited for a firmware call would be off by orders of
+	   magnitude */
+	KUNIT_EXPECT_LT(test, busy.mean_ns, 10 * idle.mean_ns + NSEC_PER_USEC);
+}
+
+/*
+ * USB charging codec. The words are the ones Acer Care Center writes
+ * and the replies the firmware of the SFG14-73 gives to them.
+ */
+static const struct {
+	bool enable;
+	u8 limit;
+	u64 word;
+} acer_test_usb_charge_words[] = {
+	{ false, 10, 663300 },
+	{ true, 10, 659204 },
+	{ true, 20, 1314564 },
+	{ true, 30, 1969924 },
+};
+
+static void acer_test_usb_charge_encode(struct kunit *test)
+{
+	for (int i = 0; i < ARRAY_SIZE(acer_test_usb_charge_words); i++)
+		KUNIT_EXPECT_EQ(test,
+				usb_charge_encode(acer_test_usb_charge_words[i].enable,
+						  acer_test_usb_charge_words[i].limit),
+				acer_test_usb_charge_words[i].word);
+}
+
+static void acer_test_usb_charge_decode(struct kunit *test)
+{
+	struct acer_usb_charge uc;
+
+	/* Replies to the words above carry no function number */
+	uc = usb_charge_decode(663296);
+	KUNIT_EXPECT_EQ(test, uc.enable, 0);
+	KUNIT_EXPECT_EQ(test, uc.limit, 10);
+
+	uc = usb_charge_decode(659200);
+	KUNIT_EXPECT_EQ(test, uc.enable, 1);
+	KUNIT_EXPECT_EQ(test, uc.limit, 10);
+
+	for (int i = 0; i < ARRAY_SIZE(acer_test_usb_charge_words); i++) {
+		uc = usb_charge_decode(acer_test_usb_charge_words[i].word);
+		KUNIT_EXPECT_EQ(test, uc.enable,
+				acer_test_usb_charge_words[i].enable);
+		KUNIT_EXPECT_EQ(test, uc.limit,
+				acer_test_usb_charge_words[i].limit);
+	}
+}
+
+static void acer_test_usb_charge_fixed_bits(struct kunit *test)
+{
+	static const u64 words[] = { 0, 659200 & ~0xf00, 659200 & ~0x100,
+				     663296 ^ 0x800, ~0ULL & ~0xf00 };
+
+	for (int i = 0; i < ARRAY_SIZE(words); i++)
+		KUNIT_EXPECT_EQ(test, usb_charge_decode(words[i]).enable, -1);
+}
+
+static struct kunit_case acer_wmi_ext_codec_test_cases[] = {
+	KUNIT_CASE(acer_test_usb_charge_encode),
+	KUNIT_CASE(acer_test_usb_charge_decode),
+	KUNIT_CASE(acer_test_usb_charge_fixed_bits),
+	{}
+};
+
+/* The codec needs no firmware, so it has a suite of its own */
+static struct kunit_suite acer_wmi_ext_codec_test_suite = {
+	.name = "acer-wmi-ext-usb-charge",
+	.test_cases = acer_wmi_ext_codec_test_cases,
+};
+
+static struct kunit_case acer_wmi_ext_test_cases[] = {
+	KUNIT_CASE(acer_test_health_mode),
+	KUNIT_CASE(acer_test_calibration_mode),
+	KUNIT_CASE(acer_test_system_control_mode),
+	KUNIT_CASE(acer_test_usb_charge_mode),
+	KUNIT_CASE(acer_test_usb_charge_limit),
+	KUNIT_CASE(acer_test_battery_discover),
+	KUNIT_CASE_PARAM(acer_test_fail_ops, acer_test_failure_gen_params),
+	KUNIT_CASE(acer_test_sensor_breaker),
+	KUNIT_CASE(acer_test_platform_profile),
+#ifdef CONFIG_PM_SLEEP
+	KUNIT_CASE(acer_test_resume_reconcile),
+#endif
+	KUNIT_CASE(acer_test_init_paths),
+	KUNIT_CASE(acer_test_init_latency),
+	KUNIT_CASE(acer_test_latency_timeout),
+	KUNIT_CASE_PARAM(acer_test_timing, acer_test_latency_gen_params),
+	KUNIT_CASE(acer_test_state_torn),
+	{}
+};
+
+static struct kunit_suite acer_wmi_ext_test_suite = {
+	.name = "acer-wmi-ext",
+	.init = acer_test_init,
+	.exit = acer_test_exit,
+	.test_cases = acer_wmi_ext_test_cases,
+};
+kunit_test_suites(&acer_wmi_ext_codec_test_suite, &acer_wmi_ext_test_suite);
@@ -0,0 +1,140 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Tracepoints for the Acer WMI extension driver
+ *
+ * Every WMI method evaluation and EC access of the driver is traced
+ * together with its duration, and every queued firmware write is
+ * traced in the context of the task that requested it. The phases of
+ * module initialization are traced as they complete.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM acer_wmi_ext
+
+#if !defined(_ACER_WMI_EXT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ACER_WMI_EXT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(acer_wmi_ext_wmi_call,
+
+	TP_PROTO(const char *op, u32 method_id, u64 input, u64 result,
+		 u32 status, u64 duration_ns),
+
+	TP_ARGS(op, method_id, input, result, status, duration_ns),
+
+	TP_STRUCT__entry(
+		__string(op, op)
+		__field(u32, method_id)
+		__field(u64, input)
+		__field(u64, result)
+		__field(u32, status)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__assign_str(op);
+		__entry->method_id = method_id;
+		__entry->input = input;
+		__entry->result = result;
+		__entry->status = status;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("op=%s method=%u input=%#llx result=%#llx status=%#x duration_ns=%llu",
+		  __get_str(op), __entry->method_id, __entry->input,
+		  __entry->result, __entry->status, __entry->duration_ns)
+);
+
+DECLARE_EVENT_CLASS(acer_wmi_ext_ec_access,
+
+	TP_PROTO(u8 offset, u8 value, int err, u64 duration_ns),
+
+	TP_ARGS(offset, value, err, duration_ns),
+
+	TP_STRUCT__entry(
+		__field(u8, offset)
+		__field(u8, value)
+		__field(int, err)
+		__field(u64, duration_ns)
+	),
+
+	TP_fast_assign(
+		__entry->offset = offset;
+		__entry->value = value;
+		__entry->err = err;
+		__entry->duration_ns = duration_ns;
+	),
+
+	TP_printk("offset=%#x value=%#x err=%d duration_ns=%llu",
+		  __entry->offset, __entry->value, __entry->err,
+		  __entry->duration_ns)
+);
+
+DEFINE_EVENT(acer_wmi_ext_ec_access, acer_wmi_ext_ec_read,
+	TP_PROTO(u8 offset, u8 value, int err, u64 duration_ns),
+	TP_ARGS(offset, value, err, duration_ns)
+);
+
+DEFINE_EVENT(acer_wmi_ext_ec_access, acer_wmi_ext_ec_write,
+	TP_PROTO(u8 offset, u8 value, int err, u64 duration_ns),
+	TP_ARGS(offset, value, err, duration_ns)
+);
+
+TRACE_EVENT(acer_wmi_ext_cmd_submit,
+
+	TP_PROTO(int type, u64 value, bool coalesced, bool wait),
+
+	TP_ARGS(type, value, coalesced, wait),
+
+	TP_STRUCT__entry(
+		__field(int, type)
+		__field(u64, value)
+		__field(bool, coalesced)
+		__field(bool, wait)
+	),
+
+	TP_fast_assign(
+		__entry->type = type;
+		__entry->value = value;
+		__entry->coalesced = coalesced;
+		__entry->wait = wait;
+	),
+
+	TP_printk("type=%d value=%llu coalesced=%d wait=%d",
+		  __entry->type, __entry->value, __entry->coalesced,
+		  __entry->wait)
+);
+
+TRACE_EVENT(acer_wmi_ext_init_phase,
+
+	TP_PROTO(const char *phase, u64 start_ns, u64 duration_ns, int result),
+
+	TP_ARGS(phase, start_ns, duration_ns, result),
+
+	TP_STRUCT__entry(
+		__string(phase, phase)
+		__field(u64, start_ns)
+		__field(u64, duration_ns)
+		__field(int, result)
+	),
+
+	TP_fast_assign(
+		__assign_str(phase);
+		__entry->start_ns = start_ns;
+		__entry->duration_ns = duration_ns;
+		__entry->result = result;
+	),
+
+	TP_printk("phase=%s start_ns=%llu duration_ns=%llu result=%d",
+		  __get_str(phase), __entry->start_ns, __entry->duration_ns,
+		  __entry->result)
+);
+
+#endif /* _ACER_WMI_EXT_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE acer-wmi-ext-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,125 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * Userspace interface of the Acer WMI extension driver
+ *
+ * The driver provides /dev/acer-wmi-ext, on which several settings can
+ * be changed with a single ioctl, and whose first page can be mapped
+ * read-only to sample the driver state without system calls. Changes
+ * of the state are broadcast on a generic netlink multicast group.
+ */
+
+#ifndef _ACER_WMI_EXT_UAPI_H
+#define _ACER_WMI_EXT_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+enum acer_wmi_ext_field {
+	ACER_WMI_EXT_FIELD_HEALTH_MODE,
+	ACER_WMI_EXT_FIELD_USB_CHARGE_MODE,
+	ACER_WMI_EXT_FIELD_USB_CHARGE_LIMIT,
+	ACER_WMI_EXT_FIELD_SYSTEM_CONTROL_MODE,
+	ACER_WMI_EXT_FIELD_NR,
+};
+
+#define ACER_WMI_EXT_F_HEALTH_MODE		(1U << ACER_WMI_EXT_FIELD_HEALTH_MODE)
+#define ACER_WMI_EXT_F_USB_CHARGE_MODE		(1U << ACER_WMI_EXT_FIELD_USB_CHARGE_MODE)
+#define ACER_WMI_EXT_F_USB_CHARGE_LIMIT		(1U << ACER_WMI_EXT_FIELD_USB_CHARGE_LIMIT)
+#define ACER_WMI_EXT_F_SYSTEM_CONTROL_MODE	(1U << ACER_WMI_EXT_FIELD_SYSTEM_CONTROL_MODE)
+#define ACER_WMI_EXT_F_ALL			((1U << ACER_WMI_EXT_FIELD_NR) - 1)
+
+/*
+ * A batch of settings, taking the same values as the sysfs attributes
+ * of the same names. Only the settings selected in fields are applied,
+ * in the order health mode, USB charging, system control mode; a
+ * setting that already has the requested value is not written. If a
+ * write fails, the settings written before it are restored.
+ */
+struct acer_wmi_ext_batch {
+	__u32 fields;		/* in: ACER_WMI_EXT_F_* to apply */
+	__u32 applied;		/* out: fields written to the firmware */
+	__u32 rolled_back;	/* out: fields restored after a failure */
+	__s32 health_mode;
+	__s32 usb_charge_mode;
+	__s32 usb_charge_limit;
+	__s32 system_control_mode;
+	__s32 result[ACER_WMI_EXT_FIELD_NR];	/* out: 0 or -errno */
+};
+
+#define ACER_WMI_EXT_IOC_MAGIC		0xAC
+#define ACER_WMI_EXT_IOC_SET_BATCH	_IOWR(ACER_WMI_EXT_IOC_MAGIC, 0x01, struct acer_wmi_ext_batch)
+
+/*
+ * State page, mapped with mmap(NULL, page size, PROT_READ, MAP_SHARED,
+ * fd, 0). Values are -1 while unknown. A generation is incremented
+ * whenever the values of its group change; the update times
+ * (CLOCK_MONOTONIC, in ns) record the last time the driver read or
+ * wrote the group. seq is odd while the driver updates the page; a
+ * consistent snapshot is read with:
+ *
+ *	do {
+ *		while ((seq = READ_ONCE(page->seq)) & 1)
+ *			;
+ *		read barrier;
+ *		snapshot = *page;
+ *		read barrier;
+ *	} while (READ_ONCE(page->seq) != seq);
+ */
+#define ACER_WMI_EXT_STATE_VERSION	1
+
+struct acer_wmi_ext_state_page {
+	__u32 seq;
+	__u32 version;
+	__s32 health_mode;
+	__s32 calibration_mode;
+	__s32 system_control_mode;
+	__s32 usb_charge_mode;
+	__s32 usb_charge_limit;
+	__u32 reserved;
+	__u64 battery_generation;
+	__u64 battery_update_ns;
+	__u64 control_mode_generation;
+	__u64 control_mode_update_ns;
+	__u64 usb_charge_generation;
+	__u64 usb_charge_update_ns;
+};
+
+/*
+ * Generic netlink events, multicast on group ACER_WMI_EXT_GENL_MCGRP
+ * of family ACER_WMI_EXT_GENL_NAME as ACER_WMI_EXT_CMD_EVENT messages.
+ * Every event carries its type and a timestamp (CLOCK_MONOTONIC, in
+ * ns). Mode changes and profile switches carry the name of the sysfs
+ * attribute that changed and its old and new values; firmware errors
+ * carry the failed operation and its error.
+ */
+#define ACER_WMI_EXT_GENL_NAME		"acer_wmi_ext"
+#define ACER_WMI_EXT_GENL_VERSION	1
+#define ACER_WMI_EXT_GENL_MCGRP		"events"
+
+enum acer_wmi_ext_event {
+	ACER_WMI_EXT_EVENT_MODE_CHANGE,
+	ACER_WMI_EXT_EVENT_CALIBRATION_COMPLETE,
+	ACER_WMI_EXT_EVENT_PROFILE_SWITCH,
+	ACER_WMI_EXT_EVENT_FW_ERROR,
+};
+
+enum {
+	ACER_WMI_EXT_CMD_UNSPEC,
+	ACER_WMI_EXT_CMD_EVENT,
+};
+
+enum {
+	ACER_WMI_EXT_A_UNSPEC,
+	ACER_WMI_EXT_A_PAD,
+	ACER_WMI_EXT_A_EVENT,		/* u32, enum acer_wmi_ext_event */
+	ACER_WMI_EXT_A_TIMESTAMP,	/* u64 */
+	ACER_WMI_EXT_A_SETTING,		/* string */
+	ACER_WMI_EXT_A_OLD,		/* s32 */
+	ACER_WMI_EXT_A_NEW,		/* s32 */
+	ACER_WMI_EXT_A_FW_OP,		/* string */
+	ACER_WMI_EXT_A_ERROR,		/* s32, -errno */
+	__ACER_WMI_EXT_A_MAX,
+};
+#define ACER_WMI_EXT_A_MAX (__ACER_WMI_EXT_A_MAX - 1)
+
+#endif /* _ACER_WMI_EXT_UAPI_H */
@@ -21,11 +21,29 @@
 #include <linux/kernel.h>
 #include <linux/module.h>
 #include <linux/acpi.h>
+#include <linux/async.h>
 #include <linux/wmi.h>
+#include <linux/debugfs.h>
+#include <linux/jiffies.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/seq_file.h>
+#include <linux/seqlock.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <net/genetlink.h>
 
 #include <linux/dmi.h>
+#include <linux/hwmon.h>
+#include <linux/input.h>
 #include <linux/platform_device.h>
 #include <linux/platform_profile.h>
+#include <linux/power_supply.h>
+#include <linux/uaccess.h>
 #include <linux/bitfield.h>
 
 MODULE_DESCRIPTION("Acer WMI control extension driver");
@@ -37,12 +55,32 @@ MODULE_ALIAS("wmi:" WMI_GUID1);
 
 #define ACER_WMID_SET_FUNCTION 1
 #define ACER_WMID_GET_FUNCTION 2
+#define ACER_USB_CHARGE_FUNCTION 0x4
+
+/*
+ * Layout of the word ApgeAction function 0x4 (USB charging) takes
+ * and returns:
+ *
+ *   bits  7..0   function (0x4 in requests, 0 in replies)
+ *   bits 11..8   always 0xf
+ *   bit  12      charging disabled
+ *   bits 23..16  charging limit in percent
+ */
+#define ACER_USB_CHARGE_FUNCTION_MASK	GENMASK_ULL(7, 0)
+#define ACER_USB_CHARGE_FIXED		GENMASK_ULL(11, 8)
+#define ACER_USB_CHARGE_DISABLED	BIT_ULL(12)
+#define ACER_USB_CHARGE_LIMIT		GENMASK_ULL(23, 16)
 
 #ifdef pr_fmt
 #undef pr_fmt
 #define pr_fmt(fmt) "%s: " fmt, KBUILD_MODNAME
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "acer-wmi-ext-trace.h"
+
+#include "acer-wmi-ext-uapi.h"
+
 struct get_battery_health_control_status_input {
 	u8 uBatteryNo;
 	u8 uFunctionQuery;
@@ -81,744 +119,4255 @@ struct battery_info {
 	s8 calibration_mode;
 };
 
-static struct battery_info battery_status;
-static short control_mode = -1;
-
-static short enable_health_mode = -1;
-static short enable_system_control_mode = -1;
+/* Batteries the driver asks the firmware about, numbered from 1 */
+#define ACER_MAX_BATTERIES 2
 
-module_param(enable_health_mode, short, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-MODULE_PARM_DESC(
-	enable_health_mode,
-	"Turn battery health mode on (value > 0) or off (value = 0) during module "
-	"initialization (default value < 0: do not modify existing settings.)");
+/*
+ * sysfs notifications
+ *
+ * The attributes belong to the platform device. Their nodes are looked
+ * up once the device has been added (see acer_sysfs_notify_init());
+ * until then changes are not notified.
+ */
+enum acer_attr {
+	ACER_ATTR_HEALTH_MODE,
+	ACER_ATTR_CALIBRATION_MODE,
+	ACER_ATTR_SYSTEM_CONTROL_MODE,
+	ACER_ATTR_USB_CHARGE_MODE,
+	ACER_ATTR_USB_CHARGE_LIMIT,
+	ACER_ATTR_CALIBRATION_PHASE,
+	ACER_ATTR_CALIBRATION_PROGRESS,
+	ACER_ATTR_NR,
+};
 
-module_param(enable_system_control_mode, short, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
-MODULE_PARM_DESC(
-	enable_system_control_mode,
-	"Set system fan control mode (0: balanced, 1: silent, 2: performance) during "
-	"module initialization (default value < 0: do not modify existing settings.)");
+/* Every battery has the first ones again in its batteryN directory */
+#define ACER_BATTERY_ATTR_NR (ACER_ATTR_CALIBRATION_MODE + 1)
+
+static const char * const acer_attr_names[ACER_ATTR_NR] = {
+	[ACER_ATTR_HEALTH_MODE] = "health_mode",
+	[ACER_ATTR_CALIBRATION_MODE] = "calibration_mode",
+	[ACER_ATTR_SYSTEM_CONTROL_MODE] = "system_control_mode",
+	[ACER_ATTR_USB_CHARGE_MODE] = "usb_charge_mode",
+	[ACER_ATTR_USB_CHARGE_LIMIT] = "usb_charge_limit",
+	[ACER_ATTR_CALIBRATION_PHASE] = "calibration_phase",
+	[ACER_ATTR_CALIBRATION_PROGRESS] = "calibration_progress",
+};
 
+static struct kernfs_node *acer_attr_kn[ACER_ATTR_NR];
+static struct kernfs_node *acer_battery_kn[ACER_MAX_BATTERIES][ACER_BATTERY_ATTR_NR];
 
- /*
-  * WMID ApgeAction interface
-  */
-static acpi_status
-acer_wmi_apgeaction_exec_u64(u32 method_id, u64 in, u64 *out) {
-	struct acpi_buffer input = { (acpi_size) sizeof(u64), (void *)(&in) };
-	struct acpi_buffer result = { ACPI_ALLOCATE_BUFFER, NULL };
-	union acpi_object *obj;
-	u64 tmp = 0;
-	acpi_status status;
-	status = wmi_evaluate_method(WMI_GUID2, 0, method_id, &input, &result);
+static void acer_sysfs_notify(unsigned long attrs)
+{
+	struct kernfs_node *kn;
+	unsigned int i;
 
-	if (ACPI_FAILURE(status))
-		return status;
-	obj = (union acpi_object *) result.pointer;
-
-	if (obj) {
-		if (obj->type == ACPI_TYPE_BUFFER) {
-			if (obj->buffer.length == sizeof(u32))
-				tmp = *((u32 *) obj->buffer.pointer);
-			else if (obj->buffer.length == sizeof(u64))
-				tmp = *((u64 *) obj->buffer.pointer);
-		} else if (obj->type == ACPI_TYPE_INTEGER) {
-			tmp = (u64) obj->integer.value;
-		}
+	for_each_set_bit(i, &attrs, ACER_ATTR_NR) {
+		kn = READ_ONCE(acer_attr_kn[i]);
+		if (kn)
+			sysfs_notify_dirent(kn);
 	}
+}
 
-	if (out)
-		*out = tmp;
-
-	kfree(result.pointer);
+static void acer_sysfs_notify_battery(unsigned int bat, enum acer_attr attr)
+{
+	struct kernfs_node *kn = READ_ONCE(acer_battery_kn[bat][attr]);
 
-	return status;
+	if (kn)
+		sysfs_notify_dirent(kn);
 }
 
-struct quirk_entry {
-	u8 system_control_mode;
-	u8 usb_charge_mode;
+/*
+ * USB charging codec, shared by the attributes, the cache and the
+ * resume reconciliation. A word whose fixed bits do not read 0xf is
+ * not a USB charging reply and decodes to enable = -1.
+ */
+struct acer_usb_charge {
+	int enable;
+	u8 limit;
 };
 
-static struct quirk_entry *quirks;
-static struct quirk_entry quirk_unknown = {
-};
-static struct quirk_entry quirk_acer_system_control_mode = {
-	.system_control_mode = 1,
-};
-static struct quirk_entry quirk_acer_sfg174_73 = {
-	.system_control_mode = 1, // Enable system control mode for this model
-	.usb_charge_mode = 1, // Enable USB charge mode for this model
-};
+/* Charging limits the firmware accepts; it reports 10% while off */
+#define ACER_USB_CHARGE_LIMIT_OFF	10
+#define ACER_USB_CHARGE_LIMIT_DEFAULT	30
 
- /*
-  * This quirk table is only for Acer/Gateway/Packard Bell family
-  * that those machines are supported by acer-wmi driver.
-  */
-static int __init dmi_matched(const struct dmi_system_id *dmi)
+static bool usb_charge_limit_valid(unsigned int limit)
 {
-	pr_info("DMI matched: %s\n", dmi->ident);
-	quirks = dmi->driver_data;
-	return 1;
+	return limit == 10 || limit == 20 || limit == 30;
 }
 
-static const struct dmi_system_id acer_quirks[] __initconst = {
-	{
-		.callback = dmi_matched,
-		.ident = "Acer Swift SFG14-73",
-		.matches = {
-			DMI_MATCH(DMI_SYS_VENDOR, "Acer"),
-			DMI_MATCH(DMI_PRODUCT_NAME, "Swift SFG14-73"),
-		},
-		.driver_data = &quirk_acer_sfg174_73,
-	},
-};
-
-/* Find which quirks are needed for a particular vendor/ model pair */
-static void __init find_quirks(void)
+static struct acer_usb_charge usb_charge_decode(u64 word)
 {
-	// For this module, only dynamically loaded quirks are supported.
-	dmi_check_system(acer_quirks);
+	struct acer_usb_charge uc = { .enable = -1 };
 
-	if (quirks == NULL)
-		quirks = &quirk_unknown;
+	if (FIELD_GET(ACER_USB_CHARGE_FIXED, word) != 0xf)
+		return uc;
+
+	uc.enable = !(word & ACER_USB_CHARGE_DISABLED);
+	uc.limit = FIELD_GET(ACER_USB_CHARGE_LIMIT, word);
+	return uc;
 }
 
-static acpi_status
-get_battery_health_control_status(struct battery_info *bat_status)
+static u64 usb_charge_encode(bool enable, u8 limit)
 {
-	union acpi_object *obj;
-	acpi_status status;
-
-	/* Acer Care Center seems to always call the WMI method
-	   with fixed parameters. This yields information about
-	   the availability and state of both health and
-	   calibration mode. The modes probably apply to
-	   all batteries of the system - if there are
-	   Acer laptops with multiple batteries? */
-	struct get_battery_health_control_status_input params = {
-		.uBatteryNo = 0x1,
-		.uFunctionQuery = 0x1,
-		.uReserved = { 0x0, 0x0 }
-	};
-	struct get_battery_health_control_status_output ret;
-
-	struct acpi_buffer input = {
-		sizeof(struct get_battery_health_control_status_input), &params
-	};
+	return FIELD_PREP(ACER_USB_CHARGE_FUNCTION_MASK, ACER_USB_CHARGE_FUNCTION) |
+	       FIELD_PREP(ACER_USB_CHARGE_FIXED, 0xf) |
+	       (enable ? 0 : ACER_USB_CHARGE_DISABLED) |
+	       FIELD_PREP(ACER_USB_CHARGE_LIMIT, limit);
+}
 
-	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+/*
+ * Netlink events
+ *
+ * Events are only built while somebody listens on the multicast group.
+ */
+static const struct genl_multicast_group acer_genl_mcgrps[] = {
+	{ .name = ACER_WMI_EXT_GENL_MCGRP },
+};
 
-	status = wmi_evaluate_method(WMI_GUID1, 0, 20, &input, &output);
-	if (ACPI_FAILURE(status))
-		return status;
+static struct genl_family acer_genl_family = {
+	.name = ACER_WMI_EXT_GENL_NAME,
+	.version = ACER_WMI_EXT_GENL_VERSION,
+	.maxattr = ACER_WMI_EXT_A_MAX,
+	.module = THIS_MODULE,
+	.mcgrps = acer_genl_mcgrps,
+	.n_mcgrps = ARRAY_SIZE(acer_genl_mcgrps),
+};
 
-	obj = output.pointer;
-	if (!obj)
-		return AE_ERROR;
-	else if (obj->type != ACPI_TYPE_BUFFER) {
-		kfree(obj);
-		return AE_ERROR;
-	}
+static bool acer_genl_registered;
 
-	ret = *((struct get_battery_health_control_status_output *)
-			obj->buffer.pointer);
-	if (obj->buffer.length != 8) {
-		pr_err("WMI battery status call returned a buffer of "
-		       "unexpected length %d\n", obj->buffer.length);
-		kfree(obj);
-		return AE_ERROR;
-	}
+static void acer_genl_event(enum acer_wmi_ext_event event, const char *setting,
+			    s32 old, s32 new, const char *fw_op, int error)
+{
+	struct sk_buff *skb;
+	void *hdr;
 
-	bat_status->health_mode = ret.uFunctionList & HEALTH_MODE ?
-					  ret.uFunctionStatus[0] > 0 :
-					  -1;
-	bat_status->calibration_mode = ret.uFunctionList & CALIBRATION_MODE ?
-					       ret.uFunctionStatus[1] > 0 :
-					       -1;
+	if (!READ_ONCE(acer_genl_registered) ||
+	    !genl_has_listeners(&acer_genl_family, &init_net, 0))
+		return;
 
-	kfree(obj);
+	skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb)
+		return;
 
-	return status;
+	hdr = genlmsg_put(skb, 0, 0, &acer_genl_family, 0,
+			  ACER_WMI_EXT_CMD_EVENT);
+	if (!hdr)
+		goto error;
+
+	if (nla_put_u32(skb, ACER_WMI_EXT_A_EVENT, event) ||
+	    nla_put_u64_64bit(skb, ACER_WMI_EXT_A_TIMESTAMP, ktime_get_ns(),
+			      ACER_WMI_EXT_A_PAD))
+		goto error;
+
+	if (setting &&
+	    (nla_put_string(skb, ACER_WMI_EXT_A_SETTING, setting) ||
+	     nla_put_s32(skb, ACER_WMI_EXT_A_OLD, old) ||
+	     nla_put_s32(skb, ACER_WMI_EXT_A_NEW, new)))
+		goto error;
+
+	if (fw_op &&
+	    (nla_put_string(skb, ACER_WMI_EXT_A_FW_OP, fw_op) ||
+	     nla_put_s32(skb, ACER_WMI_EXT_A_ERROR, error)))
+		goto error;
+
+	genlmsg_end(skb, hdr);
+	genlmsg_multicast(&acer_genl_family, skb, 0, 0, GFP_KERNEL);
+	return;
+
+error:
+	nlmsg_free(skb);
 }
 
-static acpi_status set_battery_health_control(u8 function, bool function_status)
+static int acer_genl_init(void)
 {
-	union acpi_object *obj;
-	acpi_status status;
-
-	/* Cf. comment regarding constant argument values in
-	   get_battery_health_control_status. */
-	struct set_battery_health_control_input params = {
-		.uBatteryNo = 0x1,
-		.uFunctionMask = function,
-		.uFunctionStatus = (u8)function_status,
-		.uReservedIn = { 0x0, 0x0, 0x0, 0x0, 0x0 }
-	};
-	struct set_battery_health_control_output ret;
+	int err;
 
-	struct acpi_buffer input = {
-		sizeof(struct set_battery_health_control_input), &params
-	};
+	err = genl_register_family(&acer_genl_family);
+	if (err)
+		return err;
 
-	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
-	status = wmi_evaluate_method(WMI_GUID1, 0, 21, &input, &output);
+	WRITE_ONCE(acer_genl_registered, true);
+	return 0;
+}
 
-	if (ACPI_FAILURE(status))
-		return status;
+static void acer_genl_exit(void)
+{
+	WRITE_ONCE(acer_genl_registered, false);
+	genl_unregister_family(&acer_genl_family);
+}
 
-	obj = output.pointer;
+/*
+ * Driver state
+ *
+ * Everything the sysfs attributes and the platform profile report is
+ * kept in one struct published under a seqlock. Writers only hold the
+ * lock while copying new values in, never across a firmware call, so
+ * readers never wait behind a slow WMI or EC access and never see a
+ * half-updated state.
+ *
+ * The writers notify pollers of the attributes whose value changed and
+ * send a netlink event for each, whatever caused the change: a store,
+ * the platform profile, a WMI event or the reconciliation after
+ * resume. They also publish the state in the page userspace maps from
+ * /dev/acer-wmi-ext (struct acer_wmi_ext_state_page). The page has a
+ * sequence count of its own, as the seqlock cannot be shared with
+ * userspace; it is only written with acer_state_lock held.
+ */
+enum acer_calib_phase {
+	ACER_CALIB_IDLE,
+	ACER_CALIB_CHARGING,
+	ACER_CALIB_DISCHARGING,
+	ACER_CALIB_RECHARGING,
+};
 
-	if (!obj)
-		return AE_ERROR;
-	else if (obj->type != ACPI_TYPE_BUFFER) {
-		kfree(obj);
-		return AE_ERROR;
-	}
+struct acer_state {
+	struct battery_info batteries[ACER_MAX_BATTERIES];
+	short control_mode;
+	int usb_charge_mode_enable;
+	u64 usb_charge_status;
+	u8 calibration_phase;
+	u8 calibration_progress;
+};
 
-	ret = *((struct set_battery_health_control_output *)obj->buffer.pointer);
+static DEFINE_SEQLOCK(acer_state_lock);
+static struct acer_state acer_state = {
+	.batteries = {
+		[0 ... ACER_MAX_BATTERIES - 1] = {
+			.health_mode = -1,
+			.calibration_mode = -1,
+		},
+	},
+	.control_mode = -1,
+};
 
-	if (obj->buffer.length != 4) {
-		pr_err("WMI battery status set operation returned "
-			"a buffer of unexpected length %d\n",
-			obj->buffer.length);
-		status = AE_ERROR;
-	}
+/*
+ * Number of batteries found at load (see acer_battery_discover()).
+ * The first one is the one reported by the top-level attributes, the
+ * state page and the batch ioctl; every battery also has its own
+ * attributes in a batteryN directory.
+ */
+static unsigned int acer_nr_batteries = 1;
 
-	kfree(obj);
+enum acer_state_group {
+	ACER_STATE_BATTERY,
+	ACER_STATE_CONTROL_MODE,
+	ACER_STATE_USB_CHARGE,
+};
 
-	return status;
-}
+static struct acer_wmi_ext_state_page *acer_state_page;
 
-static void print_modes(const char *prefix, bool print_if_empty,
-			bool health_mode, bool calib_mode)
+/* Called with acer_state_lock held for writing */
+static void acer_state_page_publish(enum acer_state_group group, bool changed)
 {
-	if (!health_mode && !calib_mode && !print_if_empty)
+	struct acer_wmi_ext_state_page *page = acer_state_page;
+	struct acer_usb_charge uc;
+	u64 now = ktime_get_ns();
+
+	if (!page)
 		return;
 
-	pr_info("%s modes: %s%s%s\n", prefix, health_mode ? "health mode" : "",
-		health_mode && calib_mode ? ", " : "",
-		calib_mode ? "calibration mode" : "");
+	WRITE_ONCE(page->seq, page->seq + 1);
+	smp_wmb();
+
+	switch (group) {
+	case ACER_STATE_BATTERY:
+		page->health_mode = acer_state.batteries[0].health_mode;
+		page->calibration_mode = acer_state.batteries[0].calibration_mode;
+		page->battery_generation += changed;
+		page->battery_update_ns = now;
+		break;
+	case ACER_STATE_CONTROL_MODE:
+		page->system_control_mode = acer_state.control_mode;
+		page->control_mode_generation += changed;
+		page->control_mode_update_ns = now;
+		break;
+	case ACER_STATE_USB_CHARGE:
+		uc = usb_charge_decode(acer_state.usb_charge_status);
+		page->usb_charge_mode = acer_state.usb_charge_mode_enable;
+		page->usb_charge_limit = uc.enable > 0 ? uc.limit : -1;
+		page->usb_charge_generation += changed;
+		page->usb_charge_update_ns = now;
+		break;
+	}
+
+	smp_wmb();
+	WRITE_ONCE(page->seq, page->seq + 1);
 }
 
-static acpi_status init_state(void)
+static int acer_state_page_init(void)
 {
-	bool print_state_if_empty;
-	acpi_status status;
-	status = get_battery_health_control_status(&battery_status);
+	struct acer_wmi_ext_state_page *page;
 
-	if (ACPI_FAILURE(status))
-		return status;
+	page = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
 
-	print_state_if_empty = true;
-	print_modes("available", print_state_if_empty,
-		    battery_status.health_mode >= 0,
-		    battery_status.calibration_mode >= 0);
+	page->version = ACER_WMI_EXT_STATE_VERSION;
+	page->health_mode = -1;
+	page->calibration_mode = -1;
+	page->system_control_mode = -1;
+	page->usb_charge_mode = -1;
+	page->usb_charge_limit = -1;
 
-	print_state_if_empty = false;
-	print_modes("active", print_state_if_empty,
-		    battery_status.health_mode > 0,
-		    battery_status.calibration_mode > 0);
+	write_seqlock(&acer_state_lock);
+	acer_state_page = page;
+	write_sequnlock(&acer_state_lock);
 
-	return status;
+	return 0;
 }
 
-static void update_state(void)
+static void acer_state_page_exit(void)
 {
-	struct battery_info old_state = battery_status;
-	get_battery_health_control_status(&battery_status);
-	if (battery_status.calibration_mode != old_state.calibration_mode)
-		pr_info("%s calibration mode\n",
-			battery_status.calibration_mode ? "enabled" :
-							  "disabled");
-	if (battery_status.health_mode != old_state.health_mode)
-		pr_info("%s health mode\n",
-			battery_status.health_mode ? "enabled" : "disabled");
+	free_page((unsigned long)acer_state_page);
+	acer_state_page = NULL;
 }
 
-static ssize_t health_mode_show(struct device_driver *driver, char *buf)
+static void acer_state_get(struct acer_state *state)
 {
-	int len = sprintf(buf, "%d\n", battery_status.health_mode);
-	if (len <= 0)
-		pr_err("Invalid sprintf len: %d\n", len);
+	unsigned int seq;
 
-	return len;
+	do {
+		seq = read_seqbegin(&acer_state_lock);
+		*state = acer_state;
+	} while (read_seqretry(&acer_state_lock, seq));
 }
 
-static ssize_t health_mode_store(struct device_driver *driver, const char *buf,
-				 size_t count)
+/* Value of an attribute as reported through sysfs */
+static int acer_attr_value(const struct acer_state *state, enum acer_attr attr)
 {
-	bool param_val;
-	int err;
-	if (battery_status.health_mode < 0)
-		return 0;
+	struct acer_usb_charge uc;
+
+	switch (attr) {
+	case ACER_ATTR_HEALTH_MODE:
+		return state->batteries[0].health_mode;
+	case ACER_ATTR_CALIBRATION_MODE:
+		return state->batteries[0].calibration_mode;
+	case ACER_ATTR_SYSTEM_CONTROL_MODE:
+		return state->control_mode;
+	case ACER_ATTR_USB_CHARGE_MODE:
+		return state->usb_charge_mode_enable;
+	case ACER_ATTR_USB_CHARGE_LIMIT:
+		uc = usb_charge_decode(state->usb_charge_status);
+		return uc.enable > 0 ? uc.limit : -1;
+	case ACER_ATTR_CALIBRATION_PHASE:
+		return state->calibration_phase;
+	case ACER_ATTR_CALIBRATION_PROGRESS:
+		return state->calibration_progress;
+	default:
+		return -1;
+	}
+}
 
-	err = kstrtobool(buf, &param_val);
-	if (err)
-		return err;
+static int acer_battery_value(const struct acer_state *state,
+			      unsigned int bat, enum acer_attr attr)
+{
+	const struct battery_info *battery = &state->batteries[bat];
+
+	return attr == ACER_ATTR_HEALTH_MODE ? battery->health_mode :
+					       battery->calibration_mode;
+}
+
+static unsigned long acer_state_diff(const struct acer_state *old,
+				     const struct acer_state *new)
+{
+	unsigned long changed = 0;
 
-	set_battery_health_control(HEALTH_MODE, param_val);
-	update_state();
+	for (int attr = 0; attr < ACER_ATTR_NR; attr++)
+		if (acer_attr_value(old, attr) != acer_attr_value(new, attr))
+			changed |= BIT(attr);
 
-	return count;
+	return changed;
 }
 
-static ssize_t calibration_mode_show(struct device_driver *driver, char *buf)
+static void acer_calib_work_fn(struct work_struct *work);
+static DECLARE_WORK(acer_calib_work, acer_calib_work_fn);
+static DEFINE_SPINLOCK(acer_calib_lock);
+static bool acer_calib_enabled;
+
+static void acer_calib_schedule(void)
 {
-	int len = sprintf(buf, "%d\n", battery_status.calibration_mode);
-	if (len <= 0)
-		pr_err("Invalid sprintf len: %d\n", len);
+	spin_lock(&acer_calib_lock);
+	if (acer_calib_enabled)
+		schedule_work(&acer_calib_work);
+	spin_unlock(&acer_calib_lock);
+}
 
-	return len;
+/*
+ * Changes of the batteries are also notified on their own attributes.
+ * The first battery is announced on the network under its top-level
+ * attribute names only.
+ */
+static void acer_battery_changed(const struct acer_state *old,
+				 const struct acer_state *new)
+{
+	char setting[32];
+	int old_val, new_val;
+
+	for (unsigned int bat = 0; bat < acer_nr_batteries; bat++) {
+		for (int attr = 0; attr < ACER_BATTERY_ATTR_NR; attr++) {
+			old_val = acer_battery_value(old, bat, attr);
+			new_val = acer_battery_value(new, bat, attr);
+			if (old_val == new_val)
+				continue;
+
+			acer_sysfs_notify_battery(bat, attr);
+			if (!bat)
+				continue;
+
+			snprintf(setting, sizeof(setting), "battery%u/%s",
+				 bat + 1, acer_attr_names[attr]);
+			acer_genl_event(ACER_WMI_EXT_EVENT_MODE_CHANGE, setting,
+					old_val, new_val, NULL, 0);
+		}
+	}
 }
 
-static ssize_t calibration_mode_store(struct device_driver *driver,
-				      const char *buf, size_t count)
+static void acer_state_changed(const struct acer_state *old,
+			       const struct acer_state *new)
 {
-	bool param_val;
-	int err;
+	unsigned long changed = acer_state_diff(old, new);
+	unsigned int attr;
 
-	if (battery_status.calibration_mode < 0)
-		return 0;
+	acer_sysfs_notify(changed);
 
-	err = kstrtobool(buf, &param_val);
-	if (err)
-		return err;
+	/* Start or stop following the calibration cycle */
+	if (changed & BIT(ACER_ATTR_CALIBRATION_MODE))
+		acer_calib_schedule();
 
-	set_battery_health_control(CALIBRATION_MODE, param_val);
-	update_state();
+	for_each_set_bit(attr, &changed, ACER_ATTR_NR)
+		acer_genl_event(ACER_WMI_EXT_EVENT_MODE_CHANGE,
+				acer_attr_names[attr],
+				acer_attr_value(old, attr),
+				acer_attr_value(new, attr), NULL, 0);
 
-	return count;
+	acer_battery_changed(old, new);
 }
 
-static ssize_t system_control_mode_show(struct device_driver *driver, char *buf)
+/* Publish the state of all batteries, read in one refresh */
+static void acer_state_set_batteries(const struct battery_info *batteries)
 {
-	int len = sprintf(buf, "%d\n", control_mode);
-	if (len <= 0)
-		pr_err("Invalid sprintf len: %d\n", len);
+	struct acer_state old, new;
 
-	return len;
+	write_seqlock(&acer_state_lock);
+	old = acer_state;
+	memcpy(acer_state.batteries, batteries,
+	       acer_nr_batteries * sizeof(*batteries));
+	new = acer_state;
+	acer_state_page_publish(ACER_STATE_BATTERY, acer_state_diff(&old, &new));
+	write_sequnlock(&acer_state_lock);
+
+	acer_state_changed(&old, &new);
 }
 
-static ssize_t system_control_mode_store(struct device_driver *driver,
-					 const char *buf, size_t count)
+static void acer_state_set_control_mode(short mode)
 {
-	int param_val;
-	int err;
+	struct acer_state old, new;
 
-	if (control_mode < 0)
-		return 0;
+	write_seqlock(&acer_state_lock);
+	old = acer_state;
+	acer_state.control_mode = mode;
+	new = acer_state;
+	acer_state_page_publish(ACER_STATE_CONTROL_MODE,
+				acer_state_diff(&old, &new));
+	write_sequnlock(&acer_state_lock);
 
-	err = kstrtoint(buf, 10, &param_val);
-	if (err)
-		return err;
+	acer_state_changed(&old, &new);
+}
 
-	if (param_val < SYSTEM_CONTROL_BALANCED ||
-	    param_val > SYSTEM_CONTROL_PERFORMANCE) {
-		pr_err("Invalid system control mode value: %d\n", param_val);
-		return -EINVAL;
-	}
+static void acer_state_set_usb_charge(u64 status, int enable)
+{
+	struct acer_state old, new;
 
-	pr_err("Setting system control mode to %d\n", param_val);
+	write_seqlock(&acer_state_lock);
+	old = acer_state;
+	acer_state.usb_charge_status = status;
+	acer_state.usb_charge_mode_enable = enable;
+	new = acer_state;
+	acer_state_page_publish(ACER_STATE_USB_CHARGE, acer_state_diff(&old, &new));
+	write_sequnlock(&acer_state_lock);
 
-	err = ec_write(ACER_SYSTEM_CONTROL_MODE_EC_OFFSET, param_val);
-	if (err < 0) {
-		pr_err("Failed to write system control mode to EC: %d\n", err);
-		return err;
-	}
+	acer_state_changed(&old, &new);
+}
+
+static void acer_state_set_usb_charge_enable(int enable)
+{
+	struct acer_state old, new;
 
-	control_mode = param_val;
-	pr_info("System control mode set to %d\n", control_mode);
+	write_seqlock(&acer_state_lock);
+	old = acer_state;
+	acer_state.usb_charge_mode_enable = enable;
+	new = acer_state;
+	acer_state_page_publish(ACER_STATE_USB_CHARGE, acer_state_diff(&old, &new));
+	write_sequnlock(&acer_state_lock);
 
-	return count;
+	acer_state_changed(&old, &new);
 }
 
-static int usb_charge_mode_enable = 0;
-static void init_usb_charge_mode(void)
+static void acer_state_set_calibration(u8 phase, u8 progress)
 {
-	acpi_status status;
-	u64 result;
+	struct acer_state old, new;
 
-	if (quirks->usb_charge_mode == 0) {
-		pr_info("USB charging mode quirk not enabled, skipping initialization\n");
-		return;
-	}
+	write_seqlock(&acer_state_lock);
+	old = acer_state;
+	acer_state.calibration_phase = phase;
+	acer_state.calibration_progress = progress;
+	new = acer_state;
+	write_sequnlock(&acer_state_lock);
 
-	if (!wmi_has_guid(WMI_GUID2)) {
-		pr_info("Acer USB charging control guid not found\n");
-		return;
-	}
+	acer_state_changed(&old, &new);
+}
 
-	status = acer_wmi_apgeaction_exec_u64(ACER_WMID_GET_FUNCTION, 0x4, &result);
-	if (ACPI_FAILURE(status)) {
-		pr_err("Error getting usb charging status: %s\n", acpi_format_exception(status));
+static short enable_health_mode = -1;
+static short enable_system_control_mode = -1;
+static unsigned int cache_ttl_ms = 1000;
+static bool cache_stale_while_revalidate = true;
+static unsigned int load_time_us;
+static unsigned int ec_verify_interval_ms = 1000;
+static unsigned int profile_register_time_us;
+static unsigned int fw_timeout_ms = 5000;
+static unsigned int mode_hotkey;
+static bool hwmon_sensors;
+
+module_param(enable_health_mode, short, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(
+	enable_health_mode,
+	"Turn battery health mode on (value > 0) or off (value = 0) during module "
+	"initialization (default value < 0: do not modify existing settings.)");
+
+module_param(enable_system_control_mode, short, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(
+	enable_system_control_mode,
+	"Set system fan control mode (0: balanced, 1: silent, 2: performance) during "
+	"module initialization (default value < 0: do not modify existing settings.)");
+
+module_param(cache_ttl_ms, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(
+	cache_ttl_ms,
+	"Time in milliseconds for which firmware state read through sysfs is "
+	"reused before querying the firmware again (0: always query).");
+
+module_param(cache_stale_while_revalidate, bool, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(
+	cache_stale_while_revalidate,
+	"Serve expired firmware state immediately and refresh it in the "
+	"background instead of making the reader wait (default: on).");
+
+module_param(ec_verify_interval_ms, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(
+	ec_verify_interval_ms,
+	"Minimum time in milliseconds between read-back verifications of EC "
+	"writes (0: never verify).");
+
+module_param(fw_timeout_ms, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(
+	fw_timeout_ms,
+	"Time in milliseconds a sysfs access waits for a firmware call before "
+	"failing with -ETIMEDOUT; the call still completes in the background "
+	"(0: wait forever).");
+
+module_param(mode_hotkey, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(
+	mode_hotkey,
+	"Key code the Acer WMI hotkeys device reports for the mode key; when "
+	"set, the key cycles the fan mode in the kernel instead of being "
+	"passed to userspace (default 0: off).");
+
+module_param(hwmon_sensors, bool, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(
+	hwmon_sensors,
+	"Expose the fan speed and EC temperatures of supported models through "
+	"hwmon. The EC register layout is unverified and the values may be "
+	"wrong (default: off).");
+
+module_param(load_time_us, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(load_time_us,
+		 "Time in microseconds spent in module initialization (read-only)");
+
+module_param(profile_register_time_us, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(
+	profile_register_time_us,
+	"Time in microseconds from module load until the platform profile "
+	"was registered (read-only, 0: not registered)");
+
+
+/*
+ * Firmware operation statistics
+ *
+ * Call and failure counters and a log2 latency histogram for every
+ * kind of firmware access, exported through debugfs. Bucket n counts
+ * calls that took [2^(n-1), 2^n) nanoseconds; the last bucket also
+ * takes everything slower.
+ */
+enum acer_fw_op {
+	ACER_FW_OP_BATTERY_STATUS_GET,	/* WMI method 20 */
+	ACER_FW_OP_BATTERY_CONTROL_SET,	/* WMI method 21 */
+	ACER_FW_OP_APGEACTION_GET,
+	ACER_FW_OP_APGEACTION_SET,
+	ACER_FW_OP_EC_READ,
+	ACER_FW_OP_EC_WRITE,
+	/* hwmon sensor reads; separate so that they cannot trip EC_READ */
+	ACER_FW_OP_EC_SENSOR_READ,
+	ACER_FW_OP_NR,
+};
+
+static const char * const acer_fw_op_names[ACER_FW_OP_NR] = {
+	[ACER_FW_OP_BATTERY_STATUS_GET] = "battery_status_get",
+	[ACER_FW_OP_BATTERY_CONTROL_SET] = "battery_control_set",
+	[ACER_FW_OP_APGEACTION_GET] = "apgeaction_get",
+	[ACER_FW_OP_APGEACTION_SET] = "apgeaction_set",
+	[ACER_FW_OP_EC_READ] = "ec_read",
+	[ACER_FW_OP_EC_WRITE] = "ec_write",
+	[ACER_FW_OP_EC_SENSOR_READ] = "ec_sensor_read",
+};
+
+#define ACER_FW_STATS_BUCKETS 36
+
+struct acer_fw_stats {
+	atomic64_t calls;
+	atomic64_t failures;
+	atomic64_t allocs;
+	atomic64_t latency[ACER_FW_STATS_BUCKETS];
+};
+
+static struct acer_fw_stats acer_fw_stats[ACER_FW_OP_NR];
+static atomic64_t acer_fw_timeouts;
+static struct dentry *acer_debugfs_dir;
+
+/* Account a finished firmware operation and return its duration */
+static u64 acer_fw_op_end(enum acer_fw_op op, u64 start, bool failed)
+{
+	struct acer_fw_stats *stats = &acer_fw_stats[op];
+	u64 duration = ktime_get_ns() - start;
+
+	atomic64_inc(&stats->calls);
+	if (failed)
+		atomic64_inc(&stats->failures);
+	atomic64_inc(&stats->latency[min(fls64(duration),
+					 ACER_FW_STATS_BUCKETS - 1)]);
+
+	return duration;
+}
+
+/*
+ * Free a reply the firmware allocated for op and account for it.
+ * Replies normally go into a stack buffer, so allocs stays 0 unless
+ * a backend falls back to allocating.
+ */
+static void acer_fw_reply_free(enum acer_fw_op op, void *reply)
+{
+	if (!reply)
+		return;
+
+	atomic64_inc(&acer_fw_stats[op].allocs);
+	kfree(reply);
+}
+
+static int acer_fw_stats_show(struct seq_file *m, void *v)
+{
+	for (int op = 0; op < ACER_FW_OP_NR; op++) {
+		struct acer_fw_stats *stats = &acer_fw_stats[op];
+
+		seq_printf(m, "%s: calls=%lld failures=%lld allocs=%lld\n",
+			   acer_fw_op_names[op], atomic64_read(&stats->calls),
+			   atomic64_read(&stats->failures),
+			   atomic64_read(&stats->allocs));
+
+		for (int i = 0; i < ACER_FW_STATS_BUCKETS; i++) {
+			s64 count = atomic64_read(&stats->latency[i]);
+
+			if (count)
+				seq_printf(m, "  < %llu ns: %lld\n",
+					   i < ACER_FW_STATS_BUCKETS - 1 ?
+					   1ULL << i : U64_MAX, count);
+		}
+	}
+	seq_printf(m, "timeouts: %lld\n", atomic64_read(&acer_fw_timeouts));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(acer_fw_stats);
+
+/*
+ * Firmware failure backoff
+ *
+ * An operation that fails ACER_FW_BREAKER_THRESHOLD times in a row is
+ * not attempted again for a backoff period that doubles with every
+ * further failure, up to ACER_FW_BREAKER_MAX_MS. Until the period ends
+ * callers get the last error back without touching the firmware;
+ * after it a single call is let through to probe whether the
+ * firmware has recovered.
+ */
+#define ACER_FW_BREAKER_THRESHOLD 3
+#define ACER_FW_BREAKER_MIN_MS 100
+#define ACER_FW_BREAKER_MAX_MS 60000
+
+struct acer_fw_breaker {
+	unsigned int failures;
+	unsigned long retry_at;
+	unsigned int backoff_ms;
+	int last_error;
+	bool probing;
+	u64 skipped;
+};
+
+static DEFINE_SPINLOCK(acer_fw_breaker_lock);
+static struct acer_fw_breaker acer_fw_breakers[ACER_FW_OP_NR];
+
+/*
+ * Return true if op may call the firmware, otherwise store the error
+ * of its last failure in err.
+ */
+static bool acer_fw_breaker_allow(enum acer_fw_op op, int *err)
+{
+	struct acer_fw_breaker *breaker = &acer_fw_breakers[op];
+	bool allow = true;
+
+	spin_lock(&acer_fw_breaker_lock);
+	if (breaker->failures >= ACER_FW_BREAKER_THRESHOLD) {
+		if (breaker->probing || time_before(jiffies, breaker->retry_at))
+			allow = false;
+		else
+			breaker->probing = true;
+	}
+	if (!allow) {
+		breaker->skipped++;
+		*err = breaker->last_error;
+	}
+	spin_unlock(&acer_fw_breaker_lock);
+
+	return allow;
+}
+
+/* err is 0 on success, otherwise a -errno */
+static void acer_fw_breaker_record(enum acer_fw_op op, int err)
+{
+	struct acer_fw_breaker *breaker = &acer_fw_breakers[op];
+	unsigned int backoff_ms = 0;
+	bool recovered = false;
+
+	spin_lock(&acer_fw_breaker_lock);
+	breaker->probing = false;
+	if (!err) {
+		recovered = breaker->failures >= ACER_FW_BREAKER_THRESHOLD;
+		breaker->failures = 0;
+		breaker->backoff_ms = 0;
+	} else {
+		breaker->last_error = err;
+		if (++breaker->failures >= ACER_FW_BREAKER_THRESHOLD) {
+			breaker->backoff_ms = breaker->backoff_ms ?
+				min(breaker->backoff_ms * 2, ACER_FW_BREAKER_MAX_MS) :
+				ACER_FW_BREAKER_MIN_MS;
+			breaker->retry_at = jiffies +
+				msecs_to_jiffies(breaker->backoff_ms);
+			backoff_ms = breaker->backoff_ms;
+		}
+	}
+	spin_unlock(&acer_fw_breaker_lock);
+
+	if (err)
+		acer_genl_event(ACER_WMI_EXT_EVENT_FW_ERROR, NULL, 0, 0,
+				acer_fw_op_names[op], err);
+
+	if (recovered)
+		pr_info("Firmware operation %s recovered\n", acer_fw_op_names[op]);
+	else if (backoff_ms)
+		pr_warn_ratelimited("Firmware operation %s keeps failing, retrying in %u ms\n",
+				    acer_fw_op_names[op], backoff_ms);
+}
+
+static int acer_fw_breaker_show(struct seq_file *m, void *v)
+{
+	spin_lock(&acer_fw_breaker_lock);
+	for (int op = 0; op < ACER_FW_OP_NR; op++) {
+		struct acer_fw_breaker *breaker = &acer_fw_breakers[op];
+		const char *state = "closed";
+		unsigned int retry_ms = 0;
+
+		if (breaker->probing) {
+			state = "half-open";
+		} else if (breaker->failures >= ACER_FW_BREAKER_THRESHOLD) {
+			state = "open";
+			if (time_before(jiffies, breaker->retry_at))
+				retry_ms = jiffies_to_msecs(breaker->retry_at - jiffies);
+		}
+
+		seq_printf(m, "%s: state=%s failures=%u backoff_ms=%u retry_in_ms=%u last_error=%d skipped=%llu\n",
+			   acer_fw_op_names[op], state, breaker->failures,
+			   breaker->backoff_ms, retry_ms, breaker->last_error,
+			   breaker->skipped);
+	}
+	spin_unlock(&acer_fw_breaker_lock);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(acer_fw_breaker);
+
+static void acer_debugfs_init(void)
+{
+	acer_debugfs_dir = debugfs_create_dir("acer-wmi-ext", NULL);
+	debugfs_create_file("stats", S_IRUSR, acer_debugfs_dir, NULL,
+			    &acer_fw_stats_fops);
+	debugfs_create_file("breaker", S_IRUSR, acer_debugfs_dir, NULL,
+			    &acer_fw_breaker_fops);
+}
+
+static void acer_debugfs_exit(void)
+{
+	debugfs_remove_recursive(acer_debugfs_dir);
+}
+
+/*
+ * Firmware backend
+ *
+ * All WMI and EC accesses go through acer_fw so that the driver can be
+ * run against the mock backend below instead of real firmware.
+ */
+struct acer_fw_backend {
+	const char *name;
+	bool (*wmi_has_guid)(const char *guid);
+	acpi_status (*wmi_evaluate_method)(const char *guid, u8 instance,
+					   u32 method_id,
+					   const struct acpi_buffer *in,
+					   struct acpi_buffer *out);
+	int (*ec_read)(u8 offset, u8 *value);
+	int (*ec_read_burst)(const u8 *offsets, u8 *values, unsigned int count);
+	int (*ec_write)(u8 offset, u8 value);
+};
+
+/*
+ * ACPI EC commands (ACPI 6.5, 12.3). The EC driver only exports
+ * single-byte reads, so burst reads are built from raw transactions.
+ */
+#define ACER_EC_COMMAND_READ	0x80
+#define ACER_EC_BURST_ENABLE	0x82
+#define ACER_EC_BURST_DISABLE	0x83
+#define ACER_EC_BURST_ACK	0x90
+
+/*
+ * Read several registers while the EC is in burst mode, in which it
+ * serves the host without interleaving its own work. An EC that does
+ * not acknowledge burst mode is read byte by byte.
+ *
+ * The sequence is not atomic: ec_transaction() takes the EC mutex for
+ * one command only, so other EC users can run between the reads, and
+ * one of them may end burst mode early. The burst only makes the reads
+ * faster; each one is still a complete read command, and the values
+ * are not guaranteed to be a snapshot of the same moment.
+ */
+static int acer_acpi_ec_read_burst(const u8 *offsets, u8 *values,
+				   unsigned int count)
+{
+	bool burst;
+	u8 ack = 0;
+	int err = 0;
+
+	burst = !ec_transaction(ACER_EC_BURST_ENABLE, NULL, 0, &ack, 1) &&
+		ack == ACER_EC_BURST_ACK;
+
+	for (unsigned int i = 0; i < count && !err; i++)
+		err = ec_transaction(ACER_EC_COMMAND_READ, &offsets[i], 1,
+				     &values[i], 1);
+
+	if (burst)
+		ec_transaction(ACER_EC_BURST_DISABLE, NULL, 0, NULL, 0);
+
+	return err;
+}
+
+static const struct acer_fw_backend acer_fw_backend_acpi = {
+	.name = "acpi",
+	.wmi_has_guid = wmi_has_guid,
+	.wmi_evaluate_method = wmi_evaluate_method,
+	.ec_read = ec_read,
+	.ec_read_burst = acer_acpi_ec_read_burst,
+	.ec_write = ec_write,
+};
+
+static const struct acer_fw_backend *acer_fw = &acer_fw_backend_acpi;
+
+#ifdef ACER_WMI_EXT_MOCK
+/*
+ * Mock backend
+ *
+ * Emulates the firmware of an SFG14-73 with an EC register file and a
+ * WMI responder that keeps the battery and USB charging state the
+ * real methods would report. Every call can be delayed by latency_us
+ * (initially mock_latency_us, so that it applies to the load as well)
+ * and made to fail by setting the bit of its acer_fw_op in fail_ops.
+ * Built with ACER_WMI_EXT_MOCK=1 and selected with mock_backend=1.
+ */
+static bool mock_backend;
+module_param(mock_backend, bool, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(mock_backend,
+		 "Use the emulated firmware instead of WMI and the EC (testing only)");
+
+static unsigned int mock_batteries = 1;
+module_param(mock_batteries, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(mock_batteries,
+		 "Number of batteries the emulated firmware reports (testing only)");
+
+static unsigned int mock_latency_us;
+module_param(mock_latency_us, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(mock_latency_us,
+		 "Initial latency of every emulated firmware call in microseconds (testing only)");
+
+static struct {
+	u8 ec[256];
+	u8 battery_functions;
+	u8 battery_status[ACER_MAX_BATTERIES][2];
+	u64 usb_charge;
+	u32 latency_us;
+	u32 fail_ops;
+} acer_mock = {
+	.ec = { [ACER_SYSTEM_CONTROL_MODE_EC_OFFSET] = SYSTEM_CONTROL_BALANCED },
+	.battery_functions = HEALTH_MODE | CALIBRATION_MODE,
+	/* Tell the further battery apart from battery 1 at discovery */
+	.battery_status = { [1] = { 1, 0 } },
+	.usb_charge = 1969920,
+};
+static DEFINE_MUTEX(acer_mock_lock);
+
+/* Apply the injected latency and report whether op should fail */
+static bool acer_mock_enter(enum acer_fw_op op)
+{
+	u32 latency_us = READ_ONCE(acer_mock.latency_us);
+
+	if (latency_us)
+		fsleep(latency_us);
+
+	return READ_ONCE(acer_mock.fail_ops) & BIT(op);
+}
+
+static bool acer_mock_wmi_has_guid(const char *guid)
+{
+	return true;
+}
+
+/* Return a buffer object the way ACPI does, into out or a new allocation */
+static acpi_status acer_mock_reply(struct acpi_buffer *out, const void *data,
+				   u32 length)
+{
+	union acpi_object *obj;
+
+	if (out->length == ACPI_ALLOCATE_BUFFER) {
+		obj = kzalloc(sizeof(*obj) + length, GFP_KERNEL);
+		if (!obj)
+			return AE_NO_MEMORY;
+	} else if (out->length < sizeof(*obj) + length) {
+		out->length = sizeof(*obj) + length;
+		return AE_BUFFER_OVERFLOW;
+	} else {
+		obj = out->pointer;
+	}
+
+	obj->type = ACPI_TYPE_BUFFER;
+	obj->buffer.length = length;
+	obj->buffer.pointer = (u8 *)(obj + 1);
+	memcpy(obj->buffer.pointer, data, length);
+
+	out->length = sizeof(*obj) + length;
+	out->pointer = obj;
+	return AE_OK;
+}
+
+static acpi_status
+acer_mock_wmi_evaluate_method(const char *guid, u8 instance, u32 method_id,
+			      const struct acpi_buffer *in,
+			      struct acpi_buffer *out)
+{
+	const struct set_battery_health_control_input *set_in = in->pointer;
+	u8 reply[8] = { 0 };
+	enum acer_fw_op op;
+	unsigned int bat;
+	u32 length;
+	u64 value;
+
+	if (!strcmp(guid, WMI_GUID1) && method_id == 20)
+		op = ACER_FW_OP_BATTERY_STATUS_GET;
+	else if (!strcmp(guid, WMI_GUID1) && method_id == 21)
+		op = ACER_FW_OP_BATTERY_CONTROL_SET;
+	else if (!strcmp(guid, WMI_GUID2) && method_id == ACER_WMID_GET_FUNCTION)
+		op = ACER_FW_OP_APGEACTION_GET;
+	else if (!strcmp(guid, WMI_GUID2) && method_id == ACER_WMID_SET_FUNCTION)
+		op = ACER_FW_OP_APGEACTION_SET;
+	else
+		return AE_NOT_FOUND;
+
+	if (acer_mock_enter(op))
+		return AE_ERROR;
+
+	mutex_lock(&acer_mock_lock);
+	switch (op) {
+	case ACER_FW_OP_BATTERY_STATUS_GET:
+		/* Batteries that are not installed report no modes */
+		bat = set_in->uBatteryNo - 1;
+		if (bat < min_t(unsigned int, mock_batteries, ACER_MAX_BATTERIES)) {
+			reply[0] = acer_mock.battery_functions;
+			reply[3] = acer_mock.battery_status[bat][0];
+			reply[4] = acer_mock.battery_status[bat][1];
+		}
+		length = 8;
+		break;
+	case ACER_FW_OP_BATTERY_CONTROL_SET:
+		bat = set_in->uBatteryNo - 1;
+		if (bat >= min_t(unsigned int, mock_batteries, ACER_MAX_BATTERIES)) {
+			length = 4;
+			break;
+		}
+		if (set_in->uFunctionMask & HEALTH_MODE)
+			acer_mock.battery_status[bat][0] = set_in->uFunctionStatus;
+		if (set_in->uFunctionMask & CALIBRATION_MODE)
+			acer_mock.battery_status[bat][1] = set_in->uFunctionStatus;
+		length = 4;
+		break;
+	case ACER_FW_OP_APGEACTION_SET:
+		/* The low byte selects the function, the rest is its state */
+		memcpy(&value, in->pointer, sizeof(value));
+		acer_mock.usb_charge = value & ~ACER_USB_CHARGE_FUNCTION_MASK;
+		memcpy(reply, &value, sizeof(value));
+		length = sizeof(u64);
+		break;
+	default:
+		memcpy(reply, &acer_mock.usb_charge, sizeof(u64));
+		length = sizeof(u64);
+		break;
+	}
+	mutex_unlock(&acer_mock_lock);
+
+	return acer_mock_reply(out, reply, length);
+}
+
+static int acer_mock_ec_read(u8 offset, u8 *value)
+{
+	if (acer_mock_enter(ACER_FW_OP_EC_READ))
+		return -EIO;
+
+	*value = READ_ONCE(acer_mock.ec[offset]);
+	return 0;
+}
+
+static int acer_mock_ec_read_burst(const u8 *offsets, u8 *values,
+				   unsigned int count)
+{
+	if (acer_mock_enter(ACER_FW_OP_EC_SENSOR_READ))
+		return -EIO;
+
+	for (unsigned int i = 0; i < count; i++)
+		values[i] = READ_ONCE(acer_mock.ec[offsets[i]]);
+	return 0;
+}
+
+static int acer_mock_ec_write(u8 offset, u8 value)
+{
+	if (acer_mock_enter(ACER_FW_OP_EC_WRITE))
+		return -EIO;
+
+	WRITE_ONCE(acer_mock.ec[offset], value);
+	return 0;
+}
+
+static const struct acer_fw_backend acer_fw_backend_mock = {
+	.name = "mock",
+	.wmi_has_guid = acer_mock_wmi_has_guid,
+	.wmi_evaluate_method = acer_mock_wmi_evaluate_method,
+	.ec_read = acer_mock_ec_read,
+	.ec_read_burst = acer_mock_ec_read_burst,
+	.ec_write = acer_mock_ec_write,
+};
+
+static int acer_mock_ec_show(struct seq_file *m, void *v)
+{
+	for (int i = 0; i < ARRAY_SIZE(acer_mock.ec); i++)
+		seq_printf(m, "%02x%c", READ_ONCE(acer_mock.ec[i]),
+			   i % 16 == 15 ? '\n' : ' ');
+
+	return 0;
+}
+
+static int acer_mock_ec_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, acer_mock_ec_show, NULL);
+}
+
+/* Writing "<offset> <value>" (hex) sets an EC register */
+static ssize_t acer_mock_ec_write_file(struct file *file,
+				       const char __user *ubuf, size_t count,
+				       loff_t *ppos)
+{
+	char buf[16] = { 0 };
+	u8 offset, value;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	if (sscanf(buf, "%hhx %hhx", &offset, &value) != 2)
+		return -EINVAL;
+
+	WRITE_ONCE(acer_mock.ec[offset], value);
+	return count;
+}
+
+static const struct file_operations acer_mock_ec_fops = {
+	.owner = THIS_MODULE,
+	.open = acer_mock_ec_open,
+	.read = seq_read,
+	.write = acer_mock_ec_write_file,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void acer_mock_init(struct dentry *parent)
+{
+	struct dentry *dir;
+	char name[32];
+
+	if (!mock_backend)
+		return;
+
+	pr_warn("Using the mock firmware backend\n");
+	acer_fw = &acer_fw_backend_mock;
+	acer_mock.latency_us = mock_latency_us;
+
+	dir = debugfs_create_dir("mock", parent);
+	debugfs_create_file("ec", S_IRUSR | S_IWUSR, dir, NULL,
+			    &acer_mock_ec_fops);
+	debugfs_create_u32("latency_us", S_IRUSR | S_IWUSR, dir,
+			   &acer_mock.latency_us);
+	debugfs_create_x32("fail_ops", S_IRUSR | S_IWUSR, dir,
+			   &acer_mock.fail_ops);
+	debugfs_create_x8("battery_functions", S_IRUSR | S_IWUSR, dir,
+			  &acer_mock.battery_functions);
+	debugfs_create_u8("health_mode", S_IRUSR | S_IWUSR, dir,
+			  &acer_mock.battery_status[0][0]);
+	debugfs_create_u8("calibration_mode", S_IRUSR | S_IWUSR, dir,
+			  &acer_mock.battery_status[0][1]);
+	for (unsigned int bat = 1; bat < ACER_MAX_BATTERIES; bat++) {
+		snprintf(name, sizeof(name), "battery%u_health_mode", bat + 1);
+		debugfs_create_u8(name, S_IRUSR | S_IWUSR, dir,
+				  &acer_mock.battery_status[bat][0]);
+		snprintf(name, sizeof(name), "battery%u_calibration_mode",
+			 bat + 1);
+		debugfs_create_u8(name, S_IRUSR | S_IWUSR, dir,
+				  &acer_mock.battery_status[bat][1]);
+	}
+	debugfs_create_x64("usb_charge", S_IRUSR | S_IWUSR, dir,
+			   &acer_mock.usb_charge);
+}
+#else
+#define mock_backend false
+static inline void acer_mock_init(struct dentry *parent) { }
+#endif
+
+/* Pack a WMI method argument into the u64 recorded by the tracepoints */
+static u64 acer_trace_pack(const void *buf, size_t len)
+{
+	u64 packed = 0;
+
+	memcpy(&packed, buf, min(len, sizeof(packed)));
+	return packed;
+}
+
+/*
+ * EC access
+ */
+static int acer_ec_read(u8 offset, u8 *value)
+{
+	u64 start = ktime_get_ns();
+	int err;
+
+	if (!acer_fw_breaker_allow(ACER_FW_OP_EC_READ, &err))
+		return err;
+
+	err = acer_fw->ec_read(offset, value);
+	trace_acer_wmi_ext_ec_read(offset, err ? 0 : *value, err,
+				   acer_fw_op_end(ACER_FW_OP_EC_READ, start, err));
+	acer_fw_breaker_record(ACER_FW_OP_EC_READ, err);
+	return err;
+}
+
+/*
+ * One EC sensor read operation covering count registers. It has its
+ * own statistics and breaker, so that failing sensor reads do not
+ * hold back reads of the control mode.
+ */
+static int acer_ec_read_burst(const u8 *offsets, u8 *values,
+			      unsigned int count)
+{
+	u64 start = ktime_get_ns();
+	u64 duration;
+	int err;
+
+	if (!acer_fw_breaker_allow(ACER_FW_OP_EC_SENSOR_READ, &err))
+		return err;
+
+	err = acer_fw->ec_read_burst(offsets, values, count);
+	duration = acer_fw_op_end(ACER_FW_OP_EC_SENSOR_READ, start, err);
+	for (unsigned int i = 0; i < count; i++)
+		trace_acer_wmi_ext_ec_read(offsets[i], err ? 0 : values[i], err,
+					   duration);
+	acer_fw_breaker_record(ACER_FW_OP_EC_SENSOR_READ, err);
+	return err;
+}
+
+static int acer_ec_write(u8 offset, u8 value)
+{
+	u64 start = ktime_get_ns();
+	int err;
+
+	if (!acer_fw_breaker_allow(ACER_FW_OP_EC_WRITE, &err))
+		return err;
+
+	err = acer_fw->ec_write(offset, value);
+	trace_acer_wmi_ext_ec_write(offset, value, err,
+				    acer_fw_op_end(ACER_FW_OP_EC_WRITE, start, err));
+	acer_fw_breaker_record(ACER_FW_OP_EC_WRITE, err);
+	return err;
+}
+
+/*
+ * EC shadow map
+ *
+ * Every EC register the driver uses has a shadow copy. Reads are
+ * served from the shadow once it is valid, writes go through to the
+ * EC and are skipped when the register already holds the value. A
+ * write is read back for verification at most once per
+ * ec_verify_interval_ms. The shadow is invalidated on resume and on
+ * WMI events, after which the next access reads the EC again.
+ */
+enum acer_ec_reg {
+	ACER_EC_SYSTEM_CONTROL_MODE,
+	ACER_EC_NR,
+};
+
+static const u8 acer_ec_reg_offsets[ACER_EC_NR] = {
+	[ACER_EC_SYSTEM_CONTROL_MODE] = ACER_SYSTEM_CONTROL_MODE_EC_OFFSET,
+};
+
+/* valid is also read and cleared without acer_ec_lock, see
+   acer_ec_shadow_valid(), so that nobody waits for an EC write just
+   to learn whether the shadow can be used. */
+struct acer_ec_shadow {
+	u8 value;
+	bool valid;
+	unsigned long last_verify;
+};
+
+static struct acer_ec_shadow acer_ec_shadow[ACER_EC_NR];
+static DEFINE_MUTEX(acer_ec_lock);
+
+/* Keep the published driver state in line with the shadow */
+static void acer_ec_shadow_set(enum acer_ec_reg reg, u8 value)
+{
+	lockdep_assert_held(&acer_ec_lock);
+
+	acer_ec_shadow[reg].value = value;
+	WRITE_ONCE(acer_ec_shadow[reg].valid, true);
+
+	if (reg == ACER_EC_SYSTEM_CONTROL_MODE)
+		acer_state_set_control_mode(value);
+}
+
+static int acer_ec_shadow_read(enum acer_ec_reg reg, u8 *value)
+{
+	struct acer_ec_shadow *shadow = &acer_ec_shadow[reg];
+	int err = 0;
+
+	mutex_lock(&acer_ec_lock);
+	if (!READ_ONCE(shadow->valid)) {
+		err = acer_ec_read(acer_ec_reg_offsets[reg], value);
+		if (!err)
+			acer_ec_shadow_set(reg, *value);
+	}
+	if (!err)
+		*value = shadow->value;
+	mutex_unlock(&acer_ec_lock);
+
+	return err;
+}
+
+static int acer_ec_shadow_write(enum acer_ec_reg reg, u8 value)
+{
+	struct acer_ec_shadow *shadow = &acer_ec_shadow[reg];
+	u8 offset = acer_ec_reg_offsets[reg];
+	u8 readback;
+	int err = 0;
+
+	mutex_lock(&acer_ec_lock);
+	if (READ_ONCE(shadow->valid) && shadow->value == value) {
+		pr_debug("EC register %#x already set to %#x\n", offset, value);
+		goto out;
+	}
+
+	err = acer_ec_write(offset, value);
+	if (err) {
+		/* The register may or may not have changed */
+		WRITE_ONCE(shadow->valid, false);
+		goto out;
+	}
+	acer_ec_shadow_set(reg, value);
+
+	if (!ec_verify_interval_ms ||
+	    time_before(jiffies, shadow->last_verify +
+				 msecs_to_jiffies(ec_verify_interval_ms)))
+		goto out;
+
+	shadow->last_verify = jiffies;
+	err = acer_ec_read(offset, &readback);
+	if (err) {
+		WRITE_ONCE(shadow->valid, false);
+		goto out;
+	}
+	if (readback != value) {
+		pr_warn_ratelimited("EC register %#x reads back %#x after writing %#x\n",
+				    offset, readback, value);
+		acer_ec_shadow_set(reg, readback);
+		err = -EIO;
+	}
+
+out:
+	mutex_unlock(&acer_ec_lock);
+	return err;
+}
+
+/* Does not wait for a write in progress; it sets valid when done */
+static bool acer_ec_shadow_valid(enum acer_ec_reg reg)
+{
+	return READ_ONCE(acer_ec_shadow[reg].valid);
+}
+
+static void acer_ec_shadow_invalidate_all(void)
+{
+	for (int reg = 0; reg < ACER_EC_NR; reg++)
+		WRITE_ONCE(acer_ec_shadow[reg].valid, false);
+}
+
+ /*
+  * WMI method calls
+  *
+  * Every WMI method the driver uses is described in acer_wmi_methods:
+  * where it lives, the size of its input and the layout of its reply.
+  * acer_wmi_call() evaluates a method into a reply buffer on the
+  * caller's stack, checks type and length of the reply before
+  * anything is decoded and copies the payload into the caller's
+  * output, so no call allocates memory.
+  */
+enum acer_wmi_reply_type {
+	ACER_WMI_REPLY_BUFFER,	/* buffer of exactly reply_len bytes */
+	ACER_WMI_REPLY_U64,	/* integer, 4 or 8 byte buffer, or nothing */
+};
+
+struct acer_wmi_method {
+	const char *guid;
+	u32 method_id;
+	u32 in_size;
+	enum acer_wmi_reply_type reply_type;
+	u32 reply_len;
+	u32 out_size;
+};
+
+static const struct acer_wmi_method acer_wmi_methods[] = {
+	[ACER_FW_OP_BATTERY_STATUS_GET] = {
+		.guid = WMI_GUID1,
+		.method_id = 20,
+		.in_size = sizeof(struct get_battery_health_control_status_input),
+		.reply_type = ACER_WMI_REPLY_BUFFER,
+		.reply_len = 8,
+		.out_size = sizeof(struct get_battery_health_control_status_output),
+	},
+	[ACER_FW_OP_BATTERY_CONTROL_SET] = {
+		.guid = WMI_GUID1,
+		.method_id = 21,
+		.in_size = sizeof(struct set_battery_health_control_input),
+		.reply_type = ACER_WMI_REPLY_BUFFER,
+		.reply_len = 4,
+		.out_size = sizeof(struct set_battery_health_control_output),
+	},
+	[ACER_FW_OP_APGEACTION_GET] = {
+		.guid = WMI_GUID2,
+		.method_id = ACER_WMID_GET_FUNCTION,
+		.in_size = sizeof(u64),
+		.reply_type = ACER_WMI_REPLY_U64,
+		.out_size = sizeof(u64),
+	},
+	[ACER_FW_OP_APGEACTION_SET] = {
+		.guid = WMI_GUID2,
+		.method_id = ACER_WMID_SET_FUNCTION,
+		.in_size = sizeof(u64),
+		.reply_type = ACER_WMI_REPLY_U64,
+		.out_size = sizeof(u64),
+	},
+};
+
+#define ACER_WMI_REPLY_MAX 8
+
+/* Large enough for the reply object of every method in the table */
+struct acer_wmi_reply {
+	union acpi_object obj;
+	u8 data[ACER_WMI_REPLY_MAX];
+};
+
+static acpi_status acer_wmi_decode(const struct acer_wmi_method *method,
+				   const struct acpi_buffer *output,
+				   void *out)
+{
+	const union acpi_object *obj = output->pointer;
+	u64 value = 0;
+
+	if (method->reply_type == ACER_WMI_REPLY_U64) {
+		if (!output->length) {
+			/* Method without a return value */
+		} else if (obj->type == ACPI_TYPE_INTEGER) {
+			value = obj->integer.value;
+		} else if (obj->type == ACPI_TYPE_BUFFER &&
+			   obj->buffer.length == sizeof(u32)) {
+			value = *((u32 *)obj->buffer.pointer);
+		} else if (obj->type == ACPI_TYPE_BUFFER &&
+			   obj->buffer.length == sizeof(u64)) {
+			value = *((u64 *)obj->buffer.pointer);
+		} else {
+			return AE_TYPE;
+		}
+
+		memcpy(out, &value, sizeof(value));
+		return AE_OK;
+	}
+
+	if (!output->length || obj->type != ACPI_TYPE_BUFFER)
+		return AE_TYPE;
+
+	if (obj->buffer.length != method->reply_len) {
+		pr_err("WMI method %u returned a buffer of unexpected length %u\n",
+		       method->method_id, obj->buffer.length);
+		return AE_ERROR;
+	}
+
+	memcpy(out, obj->buffer.pointer, method->out_size);
+	return AE_OK;
+}
+
+/* The breaker and its events only deal in -errno */
+static int acer_acpi_errno(acpi_status status)
+{
+	switch (status) {
+	case AE_OK:
+		return 0;
+	case AE_NOT_FOUND:
+	case AE_NOT_EXIST:
+		return -ENODEV;
+	case AE_NO_MEMORY:
+		return -ENOMEM;
+	case AE_BAD_PARAMETER:
+		return -EINVAL;
+	case AE_BUFFER_OVERFLOW:
+		return -EOVERFLOW;
+	case AE_TIME:
+		return -ETIMEDOUT;
+	default:
+		return -EIO;
+	}
+}
+
+static acpi_status acer_wmi_call(enum acer_fw_op op, const void *in, void *out)
+{
+	const struct acer_wmi_method *method = &acer_wmi_methods[op];
+	struct acer_wmi_reply reply;
+	struct acpi_buffer input = { method->in_size, (void *)in };
+	struct acpi_buffer output = { sizeof(reply), &reply };
+	u64 start = ktime_get_ns();
+	u64 result = 0;
+	acpi_status status;
+	int err;
+
+	/* Callers only tell success from failure */
+	if (!acer_fw_breaker_allow(op, &err))
+		return AE_ERROR;
+
+	status = acer_fw->wmi_evaluate_method(method->guid, 0, method->method_id,
+					      &input, &output);
+	if (status == AE_BUFFER_OVERFLOW)
+		pr_err("WMI method %u returned %llu bytes, expected at most %zu\n",
+		       method->method_id, (u64)output.length, sizeof(reply));
+	if (ACPI_SUCCESS(status))
+		status = acer_wmi_decode(method, &output, out);
+	if (ACPI_SUCCESS(status))
+		memcpy(&result, out, min_t(u32, method->out_size, sizeof(result)));
+	if (output.pointer != &reply)
+		acer_fw_reply_free(op, output.pointer);
+
+	trace_acer_wmi_ext_wmi_call(acer_fw_op_names[op], method->method_id,
+				    acer_trace_pack(in, method->in_size), result,
+				    status, acer_fw_op_end(op, start,
+							   ACPI_FAILURE(status)));
+	acer_fw_breaker_record(op, acer_acpi_errno(status));
+	return status;
+}
+
+ /*
+  * WMID ApgeAction interface
+  */
+static acpi_status
+acer_wmi_apgeaction_exec_u64(u32 method_id, u64 in, u64 *out) {
+	acpi_status status;
+	u64 result;
+
+	status = acer_wmi_call(method_id == ACER_WMID_SET_FUNCTION ?
+			       ACER_FW_OP_APGEACTION_SET :
+			       ACER_FW_OP_APGEACTION_GET, &in, &result);
+
+	if (ACPI_SUCCESS(status) && out)
+		*out = result;
+
+	return status;
+}
+
+/*
+ * EC sensor layout of a model: fan speeds are little-endian 16-bit
+ * RPM values, temperatures are single bytes in degrees Celsius.
+ */
+#define ACER_EC_SENSORS_MAX_FANS 2
+#define ACER_EC_SENSORS_MAX_TEMPS 4
+
+struct acer_ec_sensors {
+	u8 nr_fans;
+	u8 fan_rpm[ACER_EC_SENSORS_MAX_FANS];
+	u8 nr_temps;
+	u8 temp[ACER_EC_SENSORS_MAX_TEMPS];
+	const char *temp_label[ACER_EC_SENSORS_MAX_TEMPS];
+};
+
+static const struct acer_ec_sensors acer_sfg14_73_sensors = {
+	.nr_fans = 1,
+	.fan_rpm = { 0x13 },
+	.nr_temps = 2,
+	.temp = { 0xb0, 0xb3 },
+	.temp_label = { "CPU", "System" },
+};
+
+struct quirk_entry {
+	u8 system_control_mode;
+	u8 usb_charge_mode;
+	const struct acer_ec_sensors *sensors;
+};
+
+static struct quirk_entry *quirks;
+static struct quirk_entry quirk_unknown = {
+};
+static struct quirk_entry quirk_acer_system_control_mode = {
+	.system_control_mode = 1,
+};
+static struct quirk_entry quirk_acer_sfg174_73 = {
+	.system_control_mode = 1, // Enable system control mode for this model
+	.usb_charge_mode = 1, // Enable USB charge mode for this model
+	.sensors = &acer_sfg14_73_sensors,
+};
+
+ /*
+  * This quirk table is only for Acer/Gateway/Packard Bell family
+  * that those machines are supported by acer-wmi driver.
+  */
+static int __init dmi_matched(const struct dmi_system_id *dmi)
+{
+	pr_info("DMI matched: %s\n", dmi->ident);
+	quirks = dmi->driver_data;
+	return 1;
+}
+
+static const struct dmi_system_id acer_quirks[] __initconst = {
+	{
+		.callback = dmi_matched,
+		.ident = "Acer Swift SFG14-73",
+		.matches = {
+			DMI_MATCH(DMI_SYS_VENDOR, "Acer"),
+			DMI_MATCH(DMI_PRODUCT_NAME, "Swift SFG14-73"),
+		},
+		.driver_data = &quirk_acer_sfg174_73,
+	},
+};
+
+/* Find which quirks are needed for a particular vendor/ model pair */
+static void __init find_quirks(void)
+{
+	// For this module, only dynamically loaded quirks are supported.
+	if (mock_backend)
+		quirks = &quirk_acer_sfg174_73;
+	else
+		dmi_check_system(acer_quirks);
+
+	if (quirks == NULL)
+		quirks = &quirk_unknown;
+}
+
+static acpi_status
+get_battery_health_control_status(u8 battery_no, struct battery_info *bat_status)
+{
+	acpi_status status;
+
+	/* Acer Care Center calls the WMI method for battery 1
+	   only. This yields information about the availability
+	   and state of both health and calibration mode. Further
+	   batteries, such as a docked battery slice, are asked
+	   for by number, see acer_battery_discover(). */
+	struct get_battery_health_control_status_input params = {
+		.uBatteryNo = battery_no,
+		.uFunctionQuery = 0x1,
+		.uReserved = { 0x0, 0x0 }
+	};
+	struct get_battery_health_control_status_output ret;
+
+	status = acer_wmi_call(ACER_FW_OP_BATTERY_STATUS_GET, &params, &ret);
+	if (ACPI_FAILURE(status))
+		return status;
+
+	bat_status->health_mode = ret.uFunctionList & HEALTH_MODE ?
+					  ret.uFunctionStatus[0] > 0 :
+					  -1;
+	bat_status->calibration_mode = ret.uFunctionList & CALIBRATION_MODE ?
+					       ret.uFunctionStatus[1] > 0 :
+					       -1;
+
+	return status;
+}
+
+static acpi_status set_battery_health_control(u8 battery_no, u8 function,
+					      bool function_status)
+{
+	/* Cf. comment regarding the argument values in
+	   get_battery_health_control_status. */
+	struct set_battery_health_control_input params = {
+		.uBatteryNo = battery_no,
+		.uFunctionMask = function,
+		.uFunctionStatus = (u8)function_status,
+		.uReservedIn = { 0x0, 0x0, 0x0, 0x0, 0x0 }
+	};
+	struct set_battery_health_control_output ret;
+
+	return acer_wmi_call(ACER_FW_OP_BATTERY_CONTROL_SET, &params, &ret);
+}
+
+/*
+ * Count the batteries the firmware knows about. Battery 1 is always
+ * used; a further battery is present when the firmware reports at
+ * least one mode for it. Numbering is contiguous, so probing stops at
+ * the first absent battery.
+ *
+ * Firmware that ignores uBatteryNo answers every number with the state
+ * of battery 1, so a reply identical to battery 1's is taken as no
+ * battery. A real battery whose modes match battery 1's at load is
+ * missed as well.
+ */
+static void acer_battery_discover(void)
+{
+	struct battery_info first, battery;
+	unsigned int nr = 1;
+
+	if (ACPI_FAILURE(get_battery_health_control_status(1, &first)))
+		goto out;
+
+	while (nr < ACER_MAX_BATTERIES) {
+		if (ACPI_FAILURE(get_battery_health_control_status(nr + 1,
+								   &battery)))
+			break;
+		if (battery.health_mode < 0 && battery.calibration_mode < 0)
+			break;
+		if (battery.health_mode == first.health_mode &&
+		    battery.calibration_mode == first.calibration_mode)
+			break;
+		nr++;
+	}
+
+out:
+
+	acer_nr_batteries = nr;
+	if (nr > 1)
+		pr_info("Found %u batteries\n", nr);
+}
+
+/*
+ * Firmware state cache
+ *
+ * Every entry refreshes one piece of firmware-backed state (the
+ * battery and USB charging fields of acer_state). Readers reuse that
+ * state for cache_ttl_ms; once it expires they either refresh it
+ * synchronously or, with cache_stale_while_revalidate, return the
+ * last known value and let a work item refresh it in the background.
+ * Stores and WMI events invalidate the entries they affect.
+ *
+ * Synchronous refreshes also run in a work item, on a workqueue of the
+ * driver; the reader waits for at most fw_timeout_ms, and only for a
+ * refresh that started after it asked (or for the entry to become
+ * fresh). A refresh that completes after its reader gave up still
+ * updates the state and the entry.
+ *
+ * The control mode entry only re-reads an invalidated EC shadow, so
+ * that the control mode is never read from the EC without a bound.
+ */
+enum acer_cache_slot {
+	ACER_CACHE_BATTERY_STATUS,
+	ACER_CACHE_USB_CHARGE,
+	ACER_CACHE_CONTROL_MODE,
+	ACER_CACHE_NR,
+};
+
+struct acer_cache_entry {
+	int (*fetch)(void);
+	unsigned long expires;
+	unsigned int gen;
+	bool valid;
+	unsigned int started;
+	unsigned int done;
+	int err;
+	struct mutex fetch_lock;
+	struct work_struct refresh_work;
+};
+
+/* acer_cache_lock protects the entry metadata, the fetch_lock of an
+   entry serializes the firmware calls that refresh it. Entries use
+   separate firmware interfaces and refresh concurrently. */
+static DEFINE_SPINLOCK(acer_cache_lock);
+static DECLARE_WAIT_QUEUE_HEAD(acer_cache_waitq);
+static struct workqueue_struct *acer_cache_wq;
+
+/* Read every battery before publishing them all in one update. Only
+   the first battery failing fails the refresh. */
+static int acer_cache_fetch_battery_status(void)
+{
+	struct battery_info status[ACER_MAX_BATTERIES];
+	acpi_status ret;
+
+	if (ACPI_FAILURE(get_battery_health_control_status(1, &status[0])))
+		return -EIO;
+
+	/* A further battery that does not answer, e.g. an undocked slice,
+	   reads as unavailable; the others are still published. */
+	for (unsigned int bat = 1; bat < acer_nr_batteries; bat++) {
+		ret = get_battery_health_control_status(bat + 1, &status[bat]);
+		if (ACPI_FAILURE(ret)) {
+			pr_warn_ratelimited("Error getting status of battery %u: %s\n",
+					    bat + 1, acpi_format_exception(ret));
+			status[bat].health_mode = -1;
+			status[bat].calibration_mode = -1;
+		}
+	}
+
+	acer_state_set_batteries(status);
+	return 0;
+}
+
+static int acer_cache_fetch_usb_charge(void)
+{
+	acpi_status status;
+	u64 result;
+
+	status = acer_wmi_apgeaction_exec_u64(ACER_WMID_GET_FUNCTION,
+					      ACER_USB_CHARGE_FUNCTION, &result);
+	if (ACPI_FAILURE(status)) {
+		pr_err_ratelimited("Error getting usb charging status: %s\n",
+				   acpi_format_exception(status));
+		return -ENODEV;
+	}
+
+	acer_state_set_usb_charge(result, usb_charge_decode(result).enable);
+	return 0;
+}
+
+static int acer_cache_fetch_control_mode(void)
+{
+	u8 mode;
+
+	return acer_ec_shadow_read(ACER_EC_SYSTEM_CONTROL_MODE, &mode);
+}
+
+static struct acer_cache_entry acer_cache[ACER_CACHE_NR] = {
+	[ACER_CACHE_BATTERY_STATUS] = { .fetch = acer_cache_fetch_battery_status },
+	[ACER_CACHE_USB_CHARGE] = { .fetch = acer_cache_fetch_usb_charge },
+	[ACER_CACHE_CONTROL_MODE] = { .fetch = acer_cache_fetch_control_mode },
+};
+
+static bool acer_cache_fresh(const struct acer_cache_entry *entry)
+{
+	return entry->valid && time_before(jiffies, entry->expires);
+}
+
+static int acer_cache_refresh(enum acer_cache_slot slot)
+{
+	struct acer_cache_entry *entry = &acer_cache[slot];
+	unsigned int gen;
+	int err;
+
+	mutex_lock(&entry->fetch_lock);
+
+	spin_lock(&acer_cache_lock);
+	gen = entry->gen;
+	entry->started++;
+	spin_unlock(&acer_cache_lock);
+
+	err = entry->fetch();
+
+	spin_lock(&acer_cache_lock);
+	/* An invalidation that raced with the fetch wins; the next
+	   reader fetches again. */
+	if (!err && gen == entry->gen) {
+		entry->valid = true;
+		entry->expires = jiffies + msecs_to_jiffies(cache_ttl_ms);
+	}
+	entry->err = err;
+	entry->done++;
+	spin_unlock(&acer_cache_lock);
+
+	mutex_unlock(&entry->fetch_lock);
+	wake_up_all(&acer_cache_waitq);
+
+	return err;
+}
+
+static void acer_cache_refresh_work(struct work_struct *work)
+{
+	struct acer_cache_entry *entry =
+		container_of(work, struct acer_cache_entry, refresh_work);
+
+	acer_cache_refresh(entry - acer_cache);
+}
+
+static long acer_fw_timeout(void)
+{
+	unsigned int timeout_ms = READ_ONCE(fw_timeout_ms);
+
+	return timeout_ms ? msecs_to_jiffies(timeout_ms) : MAX_SCHEDULE_TIMEOUT;
+}
+
+/*
+ * Refreshes of an entry are serialized and complete in the order they
+ * started, so the refresh numbered want has finished once done reaches
+ * it. Counters wrap, hence the signed difference.
+ */
+static bool acer_cache_refreshed(struct acer_cache_entry *entry,
+				 unsigned int want, int *err)
+{
+	bool refreshed;
+
+	spin_lock(&acer_cache_lock);
+	refreshed = acer_cache_fresh(entry) || (int)(entry->done - want) >= 0;
+	*err = acer_cache_fresh(entry) ? 0 : entry->err;
+	spin_unlock(&acer_cache_lock);
+
+	return refreshed;
+}
+
+/* Refresh a slot and wait for a refresh that started after the call */
+static int acer_cache_sync(enum acer_cache_slot slot)
+{
+	struct acer_cache_entry *entry = &acer_cache[slot];
+	unsigned int want;
+	int err = 0;
+
+	spin_lock(&acer_cache_lock);
+	want = entry->started + 1;
+	spin_unlock(&acer_cache_lock);
+
+	/* Requeues the work if it is already running */
+	queue_work(acer_cache_wq, &entry->refresh_work);
+
+	if (!wait_event_timeout(acer_cache_waitq,
+				acer_cache_refreshed(entry, want, &err),
+				acer_fw_timeout())) {
+		atomic64_inc(&acer_fw_timeouts);
+		pr_warn_ratelimited("Firmware refresh %d timed out\n", slot);
+		return -ETIMEDOUT;
+	}
+
+	return err;
+}
+
+/* Make sure the backing state of a slot is recent enough to be shown */
+static int acer_cache_get(enum acer_cache_slot slot)
+{
+	struct acer_cache_entry *entry = &acer_cache[slot];
+	bool stale;
+
+	spin_lock(&acer_cache_lock);
+	if (acer_cache_fresh(entry)) {
+		spin_unlock(&acer_cache_lock);
+		return 0;
+	}
+	stale = entry->valid && cache_stale_while_revalidate;
+	spin_unlock(&acer_cache_lock);
+
+	if (stale) {
+		queue_work(acer_cache_wq, &entry->refresh_work);
+		return 0;
+	}
+
+	return acer_cache_sync(slot);
+}
+
+static void acer_cache_invalidate(enum acer_cache_slot slot)
+{
+	struct acer_cache_entry *entry = &acer_cache[slot];
+
+	spin_lock(&acer_cache_lock);
+	entry->gen++;
+	entry->expires = jiffies;
+	spin_unlock(&acer_cache_lock);
+}
+
+static void acer_cache_invalidate_all(void)
+{
+	for (int slot = 0; slot < ACER_CACHE_NR; slot++)
+		acer_cache_invalidate(slot);
+}
+
+static int acer_cache_init(void)
+{
+	acer_cache_wq = alloc_workqueue("acer_wmi_ext_cache", WQ_UNBOUND, 0);
+	if (!acer_cache_wq)
+		return -ENOMEM;
+
+	for (int slot = 0; slot < ACER_CACHE_NR; slot++) {
+		mutex_init(&acer_cache[slot].fetch_lock);
+		INIT_WORK(&acer_cache[slot].refresh_work, acer_cache_refresh_work);
+	}
+
+	return 0;
+}
+
+static void acer_cache_exit(void)
+{
+	for (int slot = 0; slot < ACER_CACHE_NR; slot++)
+		cancel_work_sync(&acer_cache[slot].refresh_work);
+	destroy_workqueue(acer_cache_wq);
+}
+
+static void print_modes(const char *prefix, bool print_if_empty,
+			bool health_mode, bool calib_mode)
+{
+	if (!health_mode && !calib_mode && !print_if_empty)
+		return;
+
+	pr_info("%s modes: %s%s%s\n", prefix, health_mode ? "health mode" : "",
+		health_mode && calib_mode ? ", " : "",
+		calib_mode ? "calibration mode" : "");
+}
+
+static acpi_status init_state(void)
+{
+	struct acer_state state;
+	bool print_state_if_empty;
+
+	acer_battery_discover();
+
+	if (acer_cache_refresh(ACER_CACHE_BATTERY_STATUS))
+		return AE_ERROR;
+
+	acer_state_get(&state);
+
+	print_state_if_empty = true;
+	print_modes("available", print_state_if_empty,
+		    state.batteries[0].health_mode >= 0,
+		    state.batteries[0].calibration_mode >= 0);
+
+	print_state_if_empty = false;
+	print_modes("active", print_state_if_empty,
+		    state.batteries[0].health_mode > 0,
+		    state.batteries[0].calibration_mode > 0);
+
+	return AE_OK;
+}
+
+/* Refresh the battery state and return the battery_mode bits that changed */
+static unsigned int update_state(void)
+{
+	struct acer_state old_state, state;
+	unsigned int changed = 0;
+
+	acer_state_get(&old_state);
+	acer_cache_invalidate(ACER_CACHE_BATTERY_STATUS);
+	if (acer_cache_refresh(ACER_CACHE_BATTERY_STATUS))
+		return 0;
+	acer_state_get(&state);
+
+	if (state.batteries[0].calibration_mode != old_state.batteries[0].calibration_mode) {
+		changed |= CALIBRATION_MODE;
+		pr_info("%s calibration mode\n",
+			state.batteries[0].calibration_mode ? "enabled" :
+							 "disabled");
+	}
+	if (state.batteries[0].health_mode != old_state.batteries[0].health_mode) {
+		changed |= HEALTH_MODE;
+		pr_info("%s health mode\n",
+			state.batteries[0].health_mode ? "enabled" : "disabled");
+	}
+
+	return changed;
+}
+
+/*
+ * Firmware command queue
+ *
+ * All WMI and EC writes are executed one at a time by a work item on
+ * an ordered workqueue. Each command type has a single pending slot:
+ * a write that is queued while an older one of the same type is
+ * still pending replaces it (last writer wins), so a burst of profile
+ * changes costs one firmware transaction. Pending commands run in the
+ * order of their most recent submission. Callers either wait for the
+ * command that carries (or superseded) their write, or return as soon
+ * as it is queued.
+ */
+enum acer_cmd_type {
+	ACER_CMD_CONTROL_MODE,
+	/* The battery modes have one slot per battery, see acer_battery_cmd() */
+	ACER_CMD_HEALTH_MODE,
+	ACER_CMD_CALIBRATION_MODE = ACER_CMD_HEALTH_MODE + ACER_MAX_BATTERIES,
+	ACER_CMD_USB_CHARGE = ACER_CMD_CALIBRATION_MODE + ACER_MAX_BATTERIES,
+	ACER_CMD_NR,
+};
+
+static enum acer_cmd_type acer_battery_cmd(unsigned int bat, enum acer_attr attr)
+{
+	return (attr == ACER_ATTR_HEALTH_MODE ? ACER_CMD_HEALTH_MODE :
+						ACER_CMD_CALIBRATION_MODE) + bat;
+}
+
+struct acer_cmd_slot {
+	u64 value;
+	u64 ticket;
+	u64 done_ticket;
+	int result;
+	bool pending;
+};
+
+static struct workqueue_struct *acer_cmd_wq;
+static DEFINE_SPINLOCK(acer_cmd_lock);
+static DECLARE_WAIT_QUEUE_HEAD(acer_cmd_waitq);
+static struct acer_cmd_slot acer_cmd_slots[ACER_CMD_NR];
+static u64 acer_cmd_next_ticket = 1;
+
+static int acer_cmd_exec(enum acer_cmd_type type, u64 value)
+{
+	acpi_status status;
+	u64 result;
+	int err;
+
+	/* Battery mode slots hold no enumerator beyond the first battery */
+	if (type >= ACER_CMD_HEALTH_MODE && type < ACER_CMD_USB_CHARGE) {
+		if (type < ACER_CMD_CALIBRATION_MODE)
+			status = set_battery_health_control(
+				type - ACER_CMD_HEALTH_MODE + 1, HEALTH_MODE,
+				value);
+		else
+			status = set_battery_health_control(
+				type - ACER_CMD_CALIBRATION_MODE + 1,
+				CALIBRATION_MODE, value);
+		update_state();
+		return ACPI_FAILURE(status) ? -EIO : 0;
+	}
+
+	switch (type) {
+	case ACER_CMD_CONTROL_MODE:
+		err = acer_ec_shadow_write(ACER_EC_SYSTEM_CONTROL_MODE, value);
+		if (err < 0) {
+			pr_err("Failed to write system control mode to EC: %d\n", err);
+			return err;
+		}
+		pr_info("System control mode set to %llu\n", value);
+		return 0;
+
+	case ACER_CMD_USB_CHARGE:
+		status = acer_wmi_apgeaction_exec_u64(ACER_WMID_SET_FUNCTION, value, &result);
+		acer_cache_invalidate(ACER_CACHE_USB_CHARGE);
+		if (ACPI_FAILURE(status)) {
+			pr_err_ratelimited("Error setting usb charging status: %s\n",
+					   acpi_format_exception(status));
+			return -ENODEV;
+		}
+		pr_info("usb charging set status: %llu\n", result);
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Take the pending command with the oldest submission, if any */
+static bool acer_cmd_next(enum acer_cmd_type *type, u64 *value, u64 *ticket)
+{
+	struct acer_cmd_slot *next = NULL;
+
+	spin_lock(&acer_cmd_lock);
+	for (int i = 0; i < ACER_CMD_NR; i++) {
+		struct acer_cmd_slot *slot = &acer_cmd_slots[i];
+
+		if (slot->pending && (!next || slot->ticket < next->ticket))
+			next = slot;
+	}
+	if (next) {
+		next->pending = false;
+		*type = next - acer_cmd_slots;
+		*value = next->value;
+		*ticket = next->ticket;
+	}
+	spin_unlock(&acer_cmd_lock);
+
+	return next;
+}
+
+static void acer_platform_profile_write_failed(void);
+
+static void acer_cmd_work_fn(struct work_struct *work)
+{
+	struct acer_state state;
+	enum acer_cmd_type type;
+	u64 value, ticket;
+	int result;
+
+	while (acer_cmd_next(&type, &value, &ticket)) {
+		acer_state_get(&state);
+		result = acer_cmd_exec(type, value);
+
+		spin_lock(&acer_cmd_lock);
+		acer_cmd_slots[type].result = result;
+		acer_cmd_slots[type].done_ticket = ticket;
+		spin_unlock(&acer_cmd_lock);
+
+		wake_up_all(&acer_cmd_waitq);
+
+		if (type != ACER_CMD_CONTROL_MODE)
+			continue;
+
+		/* Profile switches are announced once the EC has taken them,
+		   whichever path asked for them; coalesced ones never are. */
+		if (result)
+			acer_platform_profile_write_failed();
+		else if (state.control_mode != value)
+			acer_genl_event(ACER_WMI_EXT_EVENT_PROFILE_SWITCH,
+					acer_attr_names[ACER_ATTR_SYSTEM_CONTROL_MODE],
+					state.control_mode, value, NULL, 0);
+	}
+}
+
+static DECLARE_WORK(acer_cmd_work, acer_cmd_work_fn);
+
+static bool acer_cmd_done(enum acer_cmd_type type, u64 ticket, int *result)
+{
+	bool done;
+
+	spin_lock(&acer_cmd_lock);
+	done = acer_cmd_slots[type].done_ticket >= ticket;
+	if (done)
+		*result = acer_cmd_slots[type].result;
+	spin_unlock(&acer_cmd_lock);
+
+	return done;
+}
+
+/*
+ * Queue a firmware write. With wait, return the result of the command
+ * that executed it, otherwise return as soon as it is queued.
+ *
+ * Unless since is 0, the write is skipped with -EBUSY if the command
+ * type was submitted with a ticket of since or later, i.e. after
+ * acer_cmd_ticket() returned since.
+ */
+static int __acer_cmd_submit(enum acer_cmd_type type, u64 value, bool wait,
+			     u64 since)
+{
+	struct acer_cmd_slot *slot = &acer_cmd_slots[type];
+	bool coalesced;
+	int result = 0;
+	u64 ticket;
+
+	spin_lock(&acer_cmd_lock);
+	if (since && slot->ticket >= since) {
+		spin_unlock(&acer_cmd_lock);
+		return -EBUSY;
+	}
+	coalesced = slot->pending;
+	if (coalesced)
+		pr_debug("Coalescing pending command %d (%llu -> %llu)\n",
+			 type, slot->value, value);
+	ticket = acer_cmd_next_ticket++;
+	slot->value = value;
+	slot->ticket = ticket;
+	slot->pending = true;
+	spin_unlock(&acer_cmd_lock);
+
+	trace_acer_wmi_ext_cmd_submit(type, value, coalesced, wait);
+	queue_work(acer_cmd_wq, &acer_cmd_work);
+
+	/* A command that times out still runs, and updates the state when done */
+	if (wait && !wait_event_timeout(acer_cmd_waitq,
+					acer_cmd_done(type, ticket, &result),
+					acer_fw_timeout())) {
+		atomic64_inc(&acer_fw_timeouts);
+		pr_warn_ratelimited("Firmware command %d timed out\n", type);
+		return -ETIMEDOUT;
+	}
+
+	return result;
+}
+
+static int acer_cmd_submit(enum acer_cmd_type type, u64 value, bool wait)
+{
+	return __acer_cmd_submit(type, value, wait, 0);
+}
+
+/* Ticket of the next submission, to tell later writes apart */
+static u64 acer_cmd_ticket(void)
+{
+	u64 ticket;
+
+	spin_lock(&acer_cmd_lock);
+	ticket = acer_cmd_next_ticket;
+	spin_unlock(&acer_cmd_lock);
+
+	return ticket;
+}
+
+/* Value a command type will have once the queue has drained, if pending */
+static bool acer_cmd_pending_value(enum acer_cmd_type type, u64 *value)
+{
+	bool pending;
+
+	spin_lock(&acer_cmd_lock);
+	pending = acer_cmd_slots[type].pending;
+	if (pending)
+		*value = acer_cmd_slots[type].value;
+	spin_unlock(&acer_cmd_lock);
+
+	return pending;
+}
+
+static int acer_cmd_init(void)
+{
+	acer_cmd_wq = alloc_ordered_workqueue("acer-wmi-ext", 0);
+	if (!acer_cmd_wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void acer_cmd_exit(void)
+{
+	/* Let queued writes reach the firmware before going away */
+	flush_work(&acer_cmd_work);
+	destroy_workqueue(acer_cmd_wq);
+}
+
+static ssize_t acer_battery_mode_show(unsigned int bat, enum acer_attr attr,
+				      char *buf)
+{
+	struct acer_state state;
+	int len;
+	int err;
+
+	acer_state_get(&state);
+	if (acer_battery_value(&state, bat, attr) >= 0) {
+		err = acer_cache_get(ACER_CACHE_BATTERY_STATUS);
+		if (err)
+			return err;
+		acer_state_get(&state);
+	}
+
+	len = sprintf(buf, "%d\n", acer_battery_value(&state, bat, attr));
+	if (len <= 0)
+		pr_err("Invalid sprintf len: %d\n", len);
+
+	return len;
+}
+
+static ssize_t acer_battery_mode_store(unsigned int bat, enum acer_attr attr,
+				       const char *buf, size_t count)
+{
+	struct acer_state state;
+	bool param_val;
+	int err;
+
+	acer_state_get(&state);
+	if (acer_battery_value(&state, bat, attr) < 0)
+		return 0;
+
+	err = kstrtobool(buf, &param_val);
+	if (err)
+		return err;
+
+	err = acer_cmd_submit(acer_battery_cmd(bat, attr), param_val, true);
+	if (err)
+		return err;
+
+	return count;
+}
+
+static ssize_t health_mode_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return acer_battery_mode_show(0, ACER_ATTR_HEALTH_MODE, buf);
+}
+
+static ssize_t health_mode_store(struct device *dev,
+				 struct device_attribute *attr, const char *buf,
+				 size_t count)
+{
+	return acer_battery_mode_store(0, ACER_ATTR_HEALTH_MODE, buf, count);
+}
+
+static ssize_t calibration_mode_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	return acer_battery_mode_show(0, ACER_ATTR_CALIBRATION_MODE, buf);
+}
+
+static ssize_t calibration_mode_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	return acer_battery_mode_store(0, ACER_ATTR_CALIBRATION_MODE, buf,
+				       count);
+}
+
+static int system_control_mode_inited = 0;
+
+/* Re-read the control mode from the EC if its shadow was invalidated */
+static int acer_control_mode_sync(void)
+{
+	int err;
+
+	if (!system_control_mode_inited ||
+	    acer_ec_shadow_valid(ACER_EC_SYSTEM_CONTROL_MODE))
+		return 0;
+
+	/* The entry only tracks the refreshes, the shadow holds the mode */
+	acer_cache_invalidate(ACER_CACHE_CONTROL_MODE);
+	err = acer_cache_sync(ACER_CACHE_CONTROL_MODE);
+	if (err)
+		pr_err_ratelimited("Failed to read system control mode from EC: %d\n",
+				   err);
+	return err;
+}
+
+static ssize_t system_control_mode_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct acer_state state;
+	int len;
+	int err;
+
+	err = acer_control_mode_sync();
+	if (err)
+		return err;
+
+	acer_state_get(&state);
+	len = sprintf(buf, "%d\n", state.control_mode);
+	if (len <= 0)
+		pr_err("Invalid sprintf len: %d\n", len);
+
+	return len;
+}
+
+static ssize_t system_control_mode_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct acer_state state;
+	int param_val;
+	int err;
+
+	acer_state_get(&state);
+	if (state.control_mode < 0)
+		return 0;
+
+	err = kstrtoint(buf, 10, &param_val);
+	if (err)
+		return err;
+
+	if (param_val < SYSTEM_CONTROL_BALANCED ||
+	    param_val > SYSTEM_CONTROL_PERFORMANCE) {
+		pr_err("Invalid system control mode value: %d\n", param_val);
+		return -EINVAL;
+	}
+
+	pr_err("Setting system control mode to %d\n", param_val);
+
+	err = acer_cmd_submit(ACER_CMD_CONTROL_MODE, param_val, true);
+	if (err < 0)
+		return err;
+
+	return count;
+}
+
+static void init_usb_charge_mode(void)
+{
+	struct acer_state state;
+
+	if (quirks->usb_charge_mode == 0) {
+		pr_info("USB charging mode quirk not enabled, skipping initialization\n");
+		return;
+	}
+
+	if (!acer_fw->wmi_has_guid(WMI_GUID2)) {
+		pr_info("Acer USB charging control guid not found\n");
+		return;
+	}
+
+	if (acer_cache_refresh(ACER_CACHE_USB_CHARGE))
+		return;
+
+	acer_state_get(&state);
+	pr_info("usb charging get status: %llu\n", state.usb_charge_status);
+}
+
+static ssize_t usb_charge_mode_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct acer_state state;
+	int err;
+
+	if (quirks->usb_charge_mode) {
+		err = acer_cache_get(ACER_CACHE_USB_CHARGE);
+		if (err)
+			return err;
+	}
+
+	acer_state_get(&state);
+     return sprintf(buf, "%d\n", state.usb_charge_mode_enable); //-1 means unknown value
+}
+
+static ssize_t usb_charge_mode_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	u64 input_value;
+	u8 val;
+	int err;
+
+	if (quirks->usb_charge_mode == 0) {
+		pr_info("USB charging mode quirk not enabled, skipping store\n");
+		return -EOPNOTSUPP;
+	}
+
+	if (sscanf(buf, "%hhd", &val) != 1)
+		return -EINVAL;
+
+	switch (val) {
+	case 0:
+		input_value = usb_charge_encode(false, ACER_USB_CHARGE_LIMIT_OFF);
+		break;
+	case 1:
+		input_value = usb_charge_encode(true, ACER_USB_CHARGE_LIMIT_DEFAULT);
+		break;
+	default:
+		pr_err("Unknown usb charging value: %d\n", val);
+		return -EINVAL;
+	}
+
+	pr_info("usb charging set value: %d\n", val);
+	err = acer_cmd_submit(ACER_CMD_USB_CHARGE, input_value, true);
+	if (err)
+		return err;
+
+	/* Only publish what the firmware has taken */
+	acer_state_set_usb_charge_enable(val);
+	return count;
+}
+
+static ssize_t usb_charge_limit_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+
+	 struct acer_usb_charge uc;
+	 struct acer_state state;
+	 int err;
+
+	 if (quirks->usb_charge_mode == 0) {
+		 pr_info("USB charging limit quirk not enabled, skipping show\n");
+		 return -EOPNOTSUPP;
+	 }
+
+	 err = acer_cache_get(ACER_CACHE_USB_CHARGE);
+	 if (err)
+		 return err;
+
+	 acer_state_get(&state);
+     pr_debug("usb charging get limit: %llu\n", state.usb_charge_status);
+	 uc = usb_charge_decode(state.usb_charge_status);
+	 if (uc.enable <= 0)
+		 return sprintf(buf, "%d\n", -1); //-1 means unknown value or off
+
+     return sprintf(buf, "%d\n", uc.limit);
+
+}
+
+static ssize_t usb_charge_limit_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct acer_state state;
+	u64 input_value;
+	u8 val;
+	int err;
+
+	if (quirks->usb_charge_mode == 0) {
+		pr_info("USB charging limit quirk not enabled, skipping store\n");
+		return -EOPNOTSUPP;
+	}
+
+	// Ensure current value isn't 'off'
+	acer_state_get(&state);
+	if (state.usb_charge_mode_enable == 0) {
+		pr_err("USB charging is off, cannot set limit\n");
+		return -EINVAL;
+	}
+
+	if (sscanf(buf, "%hhd", &val) != 1)
+		return -EINVAL;
+
+	if (!usb_charge_limit_valid(val)) {
+		pr_err("Unknown usb charging limit value: %d\n", val);
+		return -EINVAL;
+	}
+	input_value = usb_charge_encode(true, val);
+
+	pr_info("usb charging set limit value: %d\n", val);
+	err = acer_cmd_submit(ACER_CMD_USB_CHARGE, input_value, true);
+	if (err)
+		return err;
+
+	return count;
+}
+
+/*
+ * Battery calibration
+ *
+ * While calibration mode is on, the firmware charges the battery to
+ * full, discharges it and recharges it. The driver follows these
+ * phases from the change notifications of the battery power supply
+ * and turns calibration mode off once the battery is full again,
+ * unless the firmware already did. Progress runs from 0 to 100 over
+ * the whole cycle, a third per phase.
+ *
+ * Calibration is run on WMI battery 1. The firmware does not say which
+ * power supply that is; the driver assumes it is the first ACPI
+ * battery, BAT0 (or BAT1 where numbering starts at 1), and only falls
+ * back to the first battery that reported a change for other names.
+ */
+static char acer_calib_battery[32];
+static bool acer_calib_discharged;
+
+static const char * const acer_calib_phase_names[] = {
+	[ACER_CALIB_IDLE] = "idle",
+	[ACER_CALIB_CHARGING] = "charging",
+	[ACER_CALIB_DISCHARGING] = "discharging",
+	[ACER_CALIB_RECHARGING] = "recharging",
+};
+
+static struct power_supply *acer_calib_get_battery(void)
+{
+	char name[sizeof(acer_calib_battery)];
+	struct power_supply *psy;
+
+	psy = power_supply_get_by_name("BAT0") ?:
+	      power_supply_get_by_name("BAT1");
+	if (psy)
+		return psy;
+
+	spin_lock(&acer_calib_lock);
+	strscpy(name, acer_calib_battery, sizeof(name));
+	spin_unlock(&acer_calib_lock);
+
+	return name[0] ? power_supply_get_by_name(name) : NULL;
+}
+
+static void acer_calib_work_fn(struct work_struct *work)
+{
+	union power_supply_propval status, capacity;
+	struct power_supply *psy;
+	struct acer_state state;
+	bool full;
+	int phase, progress;
+	int err;
+
+	acer_state_get(&state);
+	phase = state.calibration_phase;
+
+	if (state.batteries[0].calibration_mode != 1) {
+		if (phase != ACER_CALIB_IDLE)
+			acer_state_set_calibration(ACER_CALIB_IDLE, 0);
+		return;
+	}
+
+	if (phase == ACER_CALIB_IDLE) {
+		phase = ACER_CALIB_CHARGING;
+		acer_calib_discharged = false;
+		acer_state_set_calibration(phase, 0);
+	}
+
+	psy = acer_calib_get_battery();
+	if (!psy)
+		return;
+	err = power_supply_get_property(psy, POWER_SUPPLY_PROP_STATUS, &status);
+	if (!err)
+		err = power_supply_get_property(psy, POWER_SUPPLY_PROP_CAPACITY,
+						&capacity);
+	power_supply_put(psy);
+	if (err)
+		return;
+
+	full = status.intval == POWER_SUPPLY_STATUS_FULL ||
+	       capacity.intval >= 100;
+
+	switch (phase) {
+	case ACER_CALIB_CHARGING:
+		if (full)
+			phase = ACER_CALIB_DISCHARGING;
+		break;
+	case ACER_CALIB_DISCHARGING:
+		if (status.intval == POWER_SUPPLY_STATUS_DISCHARGING)
+			acer_calib_discharged = true;
+		else if (acer_calib_discharged &&
+			 status.intval == POWER_SUPPLY_STATUS_CHARGING)
+			phase = ACER_CALIB_RECHARGING;
+		break;
+	case ACER_CALIB_RECHARGING:
+		if (!full)
+			break;
+
+		pr_info("Battery calibration cycle finished, turning calibration mode off\n");
+		err = acer_cmd_submit(ACER_CMD_CALIBRATION_MODE, 0, true);
+		if (err) {
+			/* Still calibrating; retried on the next change */
+			pr_err_ratelimited("Failed to turn calibration mode off: %d\n",
+					   err);
+			return;
+		}
+		acer_state_set_calibration(ACER_CALIB_IDLE, 100);
+		acer_genl_event(ACER_WMI_EXT_EVENT_CALIBRATION_COMPLETE,
+				NULL, 0, 0, NULL, 0);
+		return;
+	}
+
+	capacity.intval = clamp(capacity.intval, 0, 100);
+	if (phase == ACER_CALIB_CHARGING)
+		progress = capacity.intval / 3;
+	else if (phase == ACER_CALIB_DISCHARGING)
+		progress = 33 + (100 - capacity.intval) / 3;
+	else
+		progress = 66 + capacity.intval * 34 / 100;
+
+	acer_state_set_calibration(phase, progress);
+}
+
+static int acer_calib_notify(struct notifier_block *nb, unsigned long event,
+			     void *data)
+{
+	struct power_supply *psy = data;
+	struct acer_state state;
+
+	if (event != PSY_EVENT_PROP_CHANGED ||
+	    psy->desc->type != POWER_SUPPLY_TYPE_BATTERY)
+		return NOTIFY_DONE;
+
+	spin_lock(&acer_calib_lock);
+	if (!acer_calib_battery[0])
+		strscpy(acer_calib_battery, psy->desc->name,
+			sizeof(acer_calib_battery));
+	spin_unlock(&acer_calib_lock);
+
+	/* Called in atomic context, the battery is read from a work item */
+	acer_state_get(&state);
+	if (state.batteries[0].calibration_mode == 1)
+		acer_calib_schedule();
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block acer_calib_nb = {
+	.notifier_call = acer_calib_notify,
+};
+
+static void acer_calib_init(void)
+{
+	spin_lock(&acer_calib_lock);
+	acer_calib_enabled = true;
+	spin_unlock(&acer_calib_lock);
+
+	if (power_supply_reg_notifier(&acer_calib_nb))
+		pr_warn("Unable to follow battery changes, calibration will not end automatically\n");
+
+	/* Pick up a calibration that was started before loading */
+	acer_calib_schedule();
+}
+
+static void acer_calib_exit(void)
+{
+	power_supply_unreg_notifier(&acer_calib_nb);
+
+	spin_lock(&acer_calib_lock);
+	acer_calib_enabled = false;
+	spin_unlock(&acer_calib_lock);
+	cancel_work_sync(&acer_calib_work);
+}
+
+static ssize_t calibration_phase_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct acer_state state;
+
+	acer_state_get(&state);
+	return sprintf(buf, "%s\n",
+		       acer_calib_phase_names[state.calibration_phase]);
+}
+
+static ssize_t calibration_progress_show(struct device *dev,
+					 struct device_attribute *attr,
+					 char *buf)
+{
+	struct acer_state state;
+
+	acer_state_get(&state);
+	return sprintf(buf, "%u\n", state.calibration_progress);
+}
+
+static DEVICE_ATTR_RW(health_mode);
+static DEVICE_ATTR_RW(calibration_mode);
+static DEVICE_ATTR_RO(calibration_phase);
+static DEVICE_ATTR_RO(calibration_progress);
+static DEVICE_ATTR_RW(system_control_mode);
+static DEVICE_ATTR_RW(usb_charge_mode);
+static DEVICE_ATTR_RW(usb_charge_limit);
+
+static struct attribute *acer_wmi_ext_attrs[] = {
+	&dev_attr_health_mode.attr, &dev_attr_calibration_mode.attr, &dev_attr_system_control_mode.attr, &dev_attr_usb_charge_mode.attr, &dev_attr_usb_charge_limit.attr,
+	&dev_attr_calibration_phase.attr, &dev_attr_calibration_progress.attr, NULL
+};
+
+/*
+ * Attributes of the batteries, in a batteryN directory of the device.
+ * Every attribute knows its battery, so all of them share one show and
+ * one store. Only the batteries found at load get a directory, see
+ * acer_battery_sysfs_init().
+ */
+struct acer_battery_attr {
+	struct device_attribute dev_attr;
+	unsigned int bat;
+	enum acer_attr attr;
+};
+
+#define to_acer_battery_attr(a) \
+	container_of(a, struct acer_battery_attr, dev_attr)
+
+static ssize_t acer_battery_attr_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct acer_battery_attr *battery_attr = to_acer_battery_attr(attr);
+
+	return acer_battery_mode_show(battery_attr->bat, battery_attr->attr,
+				      buf);
+}
+
+static ssize_t acer_battery_attr_store(struct device *dev,
+				       struct device_attribute *attr,
+				       const char *buf, size_t count)
+{
+	struct acer_battery_attr *battery_attr = to_acer_battery_attr(attr);
+
+	return acer_battery_mode_store(battery_attr->bat, battery_attr->attr,
+				       buf, count);
+}
+
+static struct acer_battery_sysfs {
+	char name[16];
+	struct acer_battery_attr attrs[ACER_BATTERY_ATTR_NR];
+	struct attribute *group_attrs[ACER_BATTERY_ATTR_NR + 1];
+	struct attribute_group group;
+} acer_battery_sysfs[ACER_MAX_BATTERIES];
+
+static const struct attribute_group acer_wmi_ext_group = {
+	.attrs = acer_wmi_ext_attrs,
+};
+
+static struct platform_device *acer_ext_platform_device;
+
+/* Created with the platform device, see acer_wmi_ext_init() */
+static const struct attribute_group *acer_wmi_ext_groups[ACER_MAX_BATTERIES + 2] = {
+	&acer_wmi_ext_group,
+};
+
+/* Add a batteryN group for every battery found at load */
+static void acer_battery_sysfs_init(void)
+{
+	for (unsigned int bat = 0; bat < acer_nr_batteries; bat++) {
+		struct acer_battery_sysfs *sysfs = &acer_battery_sysfs[bat];
+
+		snprintf(sysfs->name, sizeof(sysfs->name), "battery%u", bat + 1);
+		for (int i = 0; i < ACER_BATTERY_ATTR_NR; i++) {
+			struct acer_battery_attr *battery_attr = &sysfs->attrs[i];
+
+			sysfs_attr_init(&battery_attr->dev_attr.attr);
+			battery_attr->dev_attr.attr.name = acer_attr_names[i];
+			battery_attr->dev_attr.attr.mode = 0644;
+			battery_attr->dev_attr.show = acer_battery_attr_show;
+			battery_attr->dev_attr.store = acer_battery_attr_store;
+			battery_attr->bat = bat;
+			battery_attr->attr = i;
+			sysfs->group_attrs[i] = &battery_attr->dev_attr.attr;
+		}
+		sysfs->group_attrs[ACER_BATTERY_ATTR_NR] = NULL;
+		sysfs->group.name = sysfs->name;
+		sysfs->group.attrs = sysfs->group_attrs;
+		acer_wmi_ext_groups[bat + 1] = &sysfs->group;
+	}
+}
+
+/*
+ * Compatibility attributes
+ *
+ * The attributes the module had before they moved to the platform
+ * device are still attributes of the WMI driver, in
+ * /sys/bus/wmi/drivers/acer-wmi-ext/. They forward to the device
+ * attributes, which do not use their device. Changes are only notified
+ * to pollers of the device attributes, and newer attributes only exist
+ * on the device.
+ */
+#define ACER_COMPAT_ATTR(_name)						\
+static ssize_t compat_##_name##_show(struct device_driver *driver,	\
+				     char *buf)				\
+{									\
+	return _name##_show(NULL, &dev_attr_##_name, buf);		\
+}									\
+static ssize_t compat_##_name##_store(struct device_driver *driver,	\
+				      const char *buf, size_t count)	\
+{									\
+	return _name##_store(NULL, &dev_attr_##_name, buf, count);	\
+}									\
+static struct driver_attribute compat_attr_##_name =			\
+	__ATTR(_name, 0644, compat_##_name##_show, compat_##_name##_store)
+
+ACER_COMPAT_ATTR(health_mode);
+ACER_COMPAT_ATTR(calibration_mode);
+ACER_COMPAT_ATTR(system_control_mode);
+ACER_COMPAT_ATTR(usb_charge_mode);
+ACER_COMPAT_ATTR(usb_charge_limit);
+
+static struct attribute *acer_wmi_ext_compat_attrs[] = {
+	&compat_attr_health_mode.attr, &compat_attr_calibration_mode.attr, &compat_attr_system_control_mode.attr, &compat_attr_usb_charge_mode.attr, &compat_attr_usb_charge_limit.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(acer_wmi_ext_compat);
+
+static const struct wmi_device_id acer_wmi_ext_id_table[] = {
+	{ .guid_string = WMI_GUID1 },
+	{},
+};
+
+/*
+ * WMI events
+ *
+ * The battery control interface signals changes of the health and
+ * calibration mode, e.g. when the firmware ends a calibration cycle.
+ * The layout of the event data is not documented and has not been
+ * verified on hardware, so it is only logged: every event refreshes
+ * both modes, and an event that changed neither of them lets the next
+ * reader refetch the rest of the firmware state.
+ */
+
+static u64 acer_wmi_ext_event_data(const union acpi_object *obj)
+{
+	if (!obj)
+		return 0;
+
+	if (obj->type == ACPI_TYPE_INTEGER)
+		return obj->integer.value;
+
+	if (obj->type == ACPI_TYPE_BUFFER && obj->buffer.length > 0) {
+		u64 data = 0;
+
+		memcpy(&data, obj->buffer.pointer,
+		       min_t(u32, obj->buffer.length, sizeof(data)));
+		return data;
+	}
+
+	return 0;
+}
+
+/*
+ * The uevent is sent on the platform device, which owns the attributes.
+ * The WMI driver is unregistered before the device is removed, so the
+ * device exists whenever an event arrives.
+ */
+static void acer_wmi_ext_publish(unsigned int changed)
+{
+	char health[24], calibration[24];
+	struct acer_state state;
+	char *envp[3];
+	int i = 0;
+
+	acer_state_get(&state);
+
+	if (changed & HEALTH_MODE) {
+		snprintf(health, sizeof(health), "HEALTH_MODE=%d",
+			 state.batteries[0].health_mode);
+		envp[i++] = health;
+	}
+	if (changed & CALIBRATION_MODE) {
+		snprintf(calibration, sizeof(calibration),
+			 "CALIBRATION_MODE=%d", state.batteries[0].calibration_mode);
+		envp[i++] = calibration;
+	}
+	envp[i] = NULL;
+
+	kobject_uevent_env(&acer_ext_platform_device->dev.kobj, KOBJ_CHANGE,
+			   envp);
+}
+
+static void acer_wmi_ext_notify(struct wmi_device *wdev,
+				union acpi_object *obj)
+{
+	struct acer_state state;
+	bool calibrating;
+	unsigned int changed;
+
+	acer_state_get(&state);
+	calibrating = state.batteries[0].calibration_mode > 0;
+
+	pr_debug("WMI event data: %#llx\n", acer_wmi_ext_event_data(obj));
+
+	changed = update_state();
+	if (!changed) {
+		/* Not about the battery: let the next reader refetch the rest */
+		acer_cache_invalidate_all();
+		acer_ec_shadow_invalidate_all();
 		return;
 	}
 
-	pr_info("usb charging get status: %llu\n", result);
-	switch (result) {
-	case 663296: // Turn off usb charging
-		usb_charge_mode_enable = 0;
-		break;
-	case 659200: // Set usb charging to 10%
-	case 1314560: // Set usb charging to 20%
-	case 1969920: // Set usb charging to 30%
-		usb_charge_mode_enable = 1;
-		break;
-	default:
-		usb_charge_mode_enable = -1; // Unknown value
+	acer_state_get(&state);
+	if ((changed & CALIBRATION_MODE) && calibrating &&
+	    state.batteries[0].calibration_mode == 0) {
+		pr_info("Battery calibration completed\n");
+		acer_genl_event(ACER_WMI_EXT_EVENT_CALIBRATION_COMPLETE,
+				NULL, 0, 0, NULL, 0);
+	}
+
+	acer_wmi_ext_publish(changed);
+}
+
+static struct wmi_driver acer_wmi_ext_driver = {
+	.driver = {
+		.name = "acer-wmi-ext",
+		.groups = acer_wmi_ext_compat_groups,
+	},
+	.id_table = acer_wmi_ext_id_table,
+	.notify = acer_wmi_ext_notify,
+};
+
+/* Look up the nodes of the attributes once the platform device exists */
+static void acer_sysfs_notify_init(struct device *dev)
+{
+	struct kernfs_node *dir;
+	unsigned int i, bat;
+
+	for (i = 0; i < ACER_ATTR_NR; i++)
+		WRITE_ONCE(acer_attr_kn[i],
+			   sysfs_get_dirent(dev->kobj.sd, acer_attr_names[i]));
+
+	for (bat = 0; bat < acer_nr_batteries; bat++) {
+		dir = sysfs_get_dirent(dev->kobj.sd,
+				       acer_battery_sysfs[bat].name);
+		if (!dir)
+			continue;
+		for (i = 0; i < ACER_BATTERY_ATTR_NR; i++)
+			WRITE_ONCE(acer_battery_kn[bat][i],
+				   sysfs_get_dirent(dir, acer_attr_names[i]));
+		sysfs_put(dir);
+	}
+}
+
+static void acer_sysfs_notify_exit(void)
+{
+	unsigned int i, bat;
+
+	for (i = 0; i < ACER_ATTR_NR; i++) {
+		sysfs_put(acer_attr_kn[i]);
+		WRITE_ONCE(acer_attr_kn[i], NULL);
+	}
+
+	for (bat = 0; bat < ACER_MAX_BATTERIES; bat++) {
+		for (i = 0; i < ACER_BATTERY_ATTR_NR; i++) {
+			sysfs_put(acer_battery_kn[bat][i]);
+			WRITE_ONCE(acer_battery_kn[bat][i], NULL);
+		}
+	}
+}
+
+static int
+acer_system_control_mode_init(void)
+{
+	u8 tp;
+	int err;
+
+	system_control_mode_inited = 1;
+
+	err = acer_ec_shadow_read(ACER_EC_SYSTEM_CONTROL_MODE, &tp);
+	if (err < 0) {
+		pr_err("Failed to read system control mode from EC: %d\n", err);
+		return err;
+	}
+
+	pr_err("System control mode: %d\n", tp);
+
+	return 0;
+}
+
+/* Write the enable_system_control_mode parameter, once the probes passed */
+static int acer_system_control_mode_apply(void)
+{
+	int err;
+
+	if (enable_system_control_mode < 0)
+		return 0;
+
+	if (enable_system_control_mode < SYSTEM_CONTROL_BALANCED ||
+	    enable_system_control_mode > SYSTEM_CONTROL_PERFORMANCE) {
+		pr_err("Invalid system control mode value: %d\n",
+		       enable_system_control_mode);
+		return -EINVAL;
+	}
+
+	pr_info("Setting system control mode to %d\n",
+		enable_system_control_mode);
+
+	err = acer_cmd_submit(ACER_CMD_CONTROL_MODE,
+			      enable_system_control_mode, true);
+	if (err < 0)
+		return err;
+
+	return 0;
+}
+
+/*
+ * Platform profile support
+ */
+static struct device *platform_profile_device;
+static bool platform_profile_support;
+static ktime_t acer_load_start;
+
+static int
+acer_platform_profile_probe(void *drvdata, unsigned long *choices)
+{
+	int err;
+
+	if (!quirks->system_control_mode) {
+		pr_info("System control mode quirk not enabled, skipping platform profile probe\n");
+		return -EOPNOTSUPP;
+	}
+
+	// Initialize the system control mode if it hasn't been done yet
+	if (!system_control_mode_inited) {
+		err = acer_system_control_mode_init();
+		if (err)
+			return err;
+	}
+
+	// Add choices for platform profiles
+    set_bit(PLATFORM_PROFILE_LOW_POWER, choices);
+	set_bit(PLATFORM_PROFILE_BALANCED, choices);
+	set_bit(PLATFORM_PROFILE_PERFORMANCE, choices);
+
+	return 0;
+}
+
+/* The control mode, including a profile switch that is still queued */
+static short acer_control_mode_target(void)
+{
+	struct acer_state state;
+	u64 pending;
+
+	if (acer_cmd_pending_value(ACER_CMD_CONTROL_MODE, &pending))
+		return pending;
+
+	acer_control_mode_sync();
+
+	acer_state_get(&state);
+	return state.control_mode;
+}
+
+static int
+acer_platform_profile_get(struct device *dev,
+					enum platform_profile_option *profile)
+{
+	switch (acer_control_mode_target()) {
+	case SYSTEM_CONTROL_BALANCED:
+		*profile = PLATFORM_PROFILE_BALANCED;
+		break;
+	case SYSTEM_CONTROL_PERFORMANCE:
+		*profile = PLATFORM_PROFILE_PERFORMANCE;
+		break;
+	case SYSTEM_CONTROL_SILENT:
+		*profile = PLATFORM_PROFILE_LOW_POWER;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+/*
+ * Profile switches are not waited for, so a failed EC write is only
+ * seen by the command queue. The control mode was not changed; tell
+ * platform_profile to read it again instead of keeping the profile
+ * that was never applied.
+ */
+static void acer_platform_profile_write_failed(void)
+{
+	if (READ_ONCE(platform_profile_support))
+		platform_profile_notify(platform_profile_device);
+}
+
+static int
+acer_platform_profile_set(struct device *dev,
+					enum platform_profile_option profile)
+{
+	if (!quirks->system_control_mode) {
+		pr_info("System control mode quirk not enabled, skipping platform profile set\n");
+		return -EOPNOTSUPP;
+	}
+
+	int new_mode, old_mode;
+	switch (profile) {
+	case PLATFORM_PROFILE_BALANCED:
+		new_mode = SYSTEM_CONTROL_BALANCED;
+		break;
+	case PLATFORM_PROFILE_PERFORMANCE:
+		new_mode = SYSTEM_CONTROL_PERFORMANCE;
+		break;
+	case PLATFORM_PROFILE_LOW_POWER:
+		new_mode = SYSTEM_CONTROL_SILENT;
+		break;
+	default:
+		pr_err("Unsupported platform profile option: %d\n", profile);
+		return -EOPNOTSUPP;
+	}
+
+	old_mode = acer_control_mode_target();
+	if (new_mode == old_mode) {
+		pr_info("Platform profile already set to %d, no change needed\n",
+			new_mode);
+		return 0;
+	}
+
+	/* Profile switches come in bursts from userspace; let the queue
+	   coalesce them instead of waiting for each EC write. A failed
+	   write is reported by acer_platform_profile_write_failed(). */
+	pr_info("Setting platform profile to %d\n", new_mode);
+	acer_cmd_submit(ACER_CMD_CONTROL_MODE, new_mode, false);
+
+	return 0;
+}
+ 
+
+static const struct platform_profile_ops acer_platform_profile_ops = {
+	.probe = acer_platform_profile_probe,
+	.profile_get = acer_platform_profile_get,
+	.profile_set = acer_platform_profile_set,
+};
+
+#ifdef ACER_WMI_EXT_MOCK
+/*
+ * Hot path microbenchmark
+ *
+ * Writing an iteration count to the debugfs bench file runs each of
+ * the sysfs and platform profile hot paths that many times against
+ * the mock backend; reading it reports the throughput of the last run.
+ */
+enum acer_bench_path {
+	ACER_BENCH_HEALTH_MODE_SHOW,
+	ACER_BENCH_USB_CHARGE_LIMIT_SHOW,
+	ACER_BENCH_SYSTEM_CONTROL_MODE_STORE,
+	ACER_BENCH_PROFILE_GET,
+	ACER_BENCH_PROFILE_SET,
+	ACER_BENCH_NR,
+};
+
+static const char * const acer_bench_names[ACER_BENCH_NR] = {
+	[ACER_BENCH_HEALTH_MODE_SHOW] = "health_mode_show",
+	[ACER_BENCH_USB_CHARGE_LIMIT_SHOW] = "usb_charge_limit_show",
+	[ACER_BENCH_SYSTEM_CONTROL_MODE_STORE] = "system_control_mode_store",
+	[ACER_BENCH_PROFILE_GET] = "platform_profile_get",
+	[ACER_BENCH_PROFILE_SET] = "platform_profile_set",
+};
+
+struct acer_bench_result {
+	u64 iterations;
+	u64 duration_ns;
+	u64 allocs;
+};
+
+static struct acer_bench_result acer_bench_results[ACER_BENCH_NR];
+static DEFINE_MUTEX(acer_bench_lock);
+
+static u64 acer_fw_allocs(void)
+{
+	u64 allocs = 0;
+
+	for (int op = 0; op < ACER_FW_OP_NR; op++)
+		allocs += atomic64_read(&acer_fw_stats[op].allocs);
+
+	return allocs;
+}
+
+static void acer_bench_run(enum acer_bench_path path, u64 iterations,
+			   char *buf)
+{
+	static const enum platform_profile_option profiles[] = {
+		PLATFORM_PROFILE_LOW_POWER,
+		PLATFORM_PROFILE_BALANCED,
+		PLATFORM_PROFILE_PERFORMANCE,
+	};
+	static const char * const modes[] = { "1", "2", "3" };
+	struct acer_bench_result *result = &acer_bench_results[path];
+	enum platform_profile_option profile;
+	u64 allocs = acer_fw_allocs();
+	u64 start = ktime_get_ns();
+
+	for (u64 i = 0; i < iterations; i++) {
+		switch (path) {
+		case ACER_BENCH_HEALTH_MODE_SHOW:
+			health_mode_show(NULL, NULL, buf);
+			break;
+		case ACER_BENCH_USB_CHARGE_LIMIT_SHOW:
+			usb_charge_limit_show(NULL, NULL, buf);
+			break;
+		case ACER_BENCH_SYSTEM_CONTROL_MODE_STORE:
+			system_control_mode_store(NULL, NULL, modes[i % 3], 1);
+			break;
+		case ACER_BENCH_PROFILE_GET:
+			acer_platform_profile_get(NULL, &profile);
+			break;
+		case ACER_BENCH_PROFILE_SET:
+			acer_platform_profile_set(NULL, profiles[i % 3]);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* Profile switches are queued; include the EC writes they cause */
+	if (path == ACER_BENCH_PROFILE_SET)
+		flush_work(&acer_cmd_work);
+
+	result->iterations = iterations;
+	result->duration_ns = ktime_get_ns() - start;
+	result->allocs = acer_fw_allocs() - allocs;
+}
+
+static int acer_bench_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&acer_bench_lock);
+	for (int path = 0; path < ACER_BENCH_NR; path++) {
+		struct acer_bench_result *result = &acer_bench_results[path];
+
+		if (!result->iterations)
+			continue;
+
+		seq_printf(m, "%s: iterations=%llu ops_per_sec=%llu ns_per_op=%llu allocs_per_op=%llu.%03llu\n",
+			   acer_bench_names[path], result->iterations,
+			   div64_u64(result->iterations * NSEC_PER_SEC,
+				     max_t(u64, result->duration_ns, 1)),
+			   div64_u64(result->duration_ns, result->iterations),
+			   div64_u64(result->allocs, result->iterations),
+			   div64_u64(result->allocs * 1000, result->iterations) % 1000);
 	}
+	mutex_unlock(&acer_bench_lock);
+
+	return 0;
 }
 
-static ssize_t usb_charge_mode_show(struct device_driver *driver, char *buf)
+static int acer_bench_open(struct inode *inode, struct file *file)
 {
-     return sprintf(buf, "%d\n", usb_charge_mode_enable); //-1 means unknown value
+	return single_open(file, acer_bench_show, NULL);
 }
 
-static ssize_t usb_charge_mode_store(struct device_driver *driver,
-				      const char *buf, size_t count)
+static ssize_t acer_bench_write(struct file *file, const char __user *ubuf,
+				size_t count, loff_t *ppos)
 {
-	acpi_status status;
-	u64 result;
-	u64 input_value;
-	u8 val;
+	unsigned int iterations;
+	char *buf;
+	int err;
 
-	if (quirks->usb_charge_mode == 0) {
-		pr_info("USB charging mode quirk not enabled, skipping store\n");
-		return -EOPNOTSUPP;
+	err = kstrtouint_from_user(ubuf, count, 0, &iterations);
+	if (err)
+		return err;
+	if (!iterations || iterations > 1000000)
+		return -EINVAL;
+
+	buf = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	mutex_lock(&acer_bench_lock);
+	for (int path = 0; path < ACER_BENCH_NR; path++)
+		acer_bench_run(path, iterations, buf);
+	mutex_unlock(&acer_bench_lock);
+
+	kfree(buf);
+	return count;
+}
+
+static const struct file_operations acer_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = acer_bench_open,
+	.read = seq_read,
+	.write = acer_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Profile switch latency benchmark
+ *
+ * Writing "<switches> [<burst>]" to the debugfs bench_profile file
+ * switches the fan mode that many times through the platform profile
+ * and through the system_control_mode attribute, in bursts of
+ * back-to-back switches. After each burst the mock EC register is
+ * polled until it holds the mode the burst ended with; the latency of
+ * every switch in the burst is the time from its call until then,
+ * which includes the time it spent superseded in the command queue.
+ * The EC is polled every 10-20us, which bounds the latency resolution.
+ * Reading the file reports p50/p99/max latency and the switch rate of
+ * the last run. The per-transaction EC latency is set with
+ * mock/latency_us.
+ */
+#define ACER_BENCH_PROFILE_DEADLINE_NS (10 * NSEC_PER_SEC)
+
+enum acer_bench_switch_path {
+	ACER_BENCH_SWITCH_PROFILE_SET,
+	ACER_BENCH_SWITCH_CONTROL_MODE_STORE,
+	ACER_BENCH_SWITCH_NR,
+};
+
+static const char * const acer_bench_switch_names[ACER_BENCH_SWITCH_NR] = {
+	[ACER_BENCH_SWITCH_PROFILE_SET] = "platform_profile_set",
+	[ACER_BENCH_SWITCH_CONTROL_MODE_STORE] = "system_control_mode_store",
+};
+
+struct acer_bench_switch_result {
+	u64 switches;
+	u32 burst;
+	u64 duration_ns;
+	u64 p50_ns;
+	u64 p99_ns;
+	u64 max_ns;
+	u64 timeouts;
+};
+
+static struct acer_bench_switch_result acer_bench_switch_results[ACER_BENCH_SWITCH_NR];
+
+static int acer_bench_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void acer_bench_switch(enum acer_bench_switch_path path, int mode)
+{
+	static const enum platform_profile_option profiles[] = {
+		[SYSTEM_CONTROL_BALANCED] = PLATFORM_PROFILE_BALANCED,
+		[SYSTEM_CONTROL_SILENT] = PLATFORM_PROFILE_LOW_POWER,
+		[SYSTEM_CONTROL_PERFORMANCE] = PLATFORM_PROFILE_PERFORMANCE,
+	};
+	static const char * const modes[] = { "0", "1", "2", "3" };
+
+	if (path == ACER_BENCH_SWITCH_PROFILE_SET)
+		acer_platform_profile_set(NULL, profiles[mode]);
+	else
+		system_control_mode_store(NULL, NULL, modes[mode], 1);
+}
+
+static void acer_bench_switch_run(enum acer_bench_switch_path path,
+				  u32 switches, u32 burst, u64 *samples)
+{
+	struct acer_bench_switch_result *result = &acer_bench_switch_results[path];
+	u8 *ec = &acer_mock.ec[ACER_SYSTEM_CONTROL_MODE_EC_OFFSET];
+	u64 start = ktime_get_ns();
+	u64 burst_start[64];
+	u32 done = 0, i, n;
+	int mode = READ_ONCE(*ec);
+	u64 visible;
+
+	result->timeouts = 0;
+
+	while (done < switches) {
+		n = min(burst, switches - done);
+
+		/* Cycle through the modes, starting after the current one */
+		for (i = 0; i < n; i++) {
+			mode = mode % SYSTEM_CONTROL_PERFORMANCE + 1;
+			burst_start[i] = ktime_get_ns();
+			acer_bench_switch(path, mode);
+		}
+
+		while (READ_ONCE(*ec) != mode) {
+			if (ktime_get_ns() - burst_start[n - 1] >
+			    ACER_BENCH_PROFILE_DEADLINE_NS) {
+				result->timeouts++;
+				break;
+			}
+			/* Sleep between polls instead of spinning the CPU */
+			usleep_range(10, 20);
+		}
+		visible = ktime_get_ns();
+
+		for (i = 0; i < n; i++)
+			samples[done + i] = visible - burst_start[i];
+		done += n;
 	}
 
-	if (sscanf(buf, "%hhd", &val) != 1)
+	result->duration_ns = ktime_get_ns() - start;
+	result->switches = switches;
+	result->burst = burst;
+
+	sort(samples, switches, sizeof(*samples), acer_bench_cmp_u64, NULL);
+	result->p50_ns = samples[(switches - 1) / 2];
+	result->p99_ns = samples[div_u64((u64)(switches - 1) * 99, 100)];
+	result->max_ns = samples[switches - 1];
+}
+
+static int acer_bench_profile_show(struct seq_file *m, void *v)
+{
+	mutex_lock(&acer_bench_lock);
+	for (int path = 0; path < ACER_BENCH_SWITCH_NR; path++) {
+		struct acer_bench_switch_result *result =
+			&acer_bench_switch_results[path];
+
+		if (!result->switches)
+			continue;
+
+		seq_printf(m, "%s: switches=%llu burst=%u p50_ns=%llu p99_ns=%llu max_ns=%llu switches_per_sec=%llu timeouts=%llu\n",
+			   acer_bench_switch_names[path], result->switches,
+			   result->burst, result->p50_ns, result->p99_ns,
+			   result->max_ns,
+			   div64_u64(result->switches * NSEC_PER_SEC,
+				     max_t(u64, result->duration_ns, 1)),
+			   result->timeouts);
+	}
+	mutex_unlock(&acer_bench_lock);
+
+	return 0;
+}
+
+static int acer_bench_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, acer_bench_profile_show, NULL);
+}
+
+static ssize_t acer_bench_profile_write(struct file *file,
+					const char __user *ubuf,
+					size_t count, loff_t *ppos)
+{
+	unsigned int switches, burst = 1;
+	char buf[32];
+	u64 *samples;
+
+	if (count >= sizeof(buf))
 		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
 
-	switch (val) {
-	case 0:
-		input_value = 663300; // Turn off usb charging
-		break;
-	case 1:
-		input_value = 1969924; // Set usb charging to 30%
-		break;
-	default:
-		pr_err("Unknown usb charging value: %d\n", val);
+	if (sscanf(buf, "%u %u", &switches, &burst) < 1)
 		return -EINVAL;
+	if (!switches || switches > 100000 || !burst || burst > 64)
+		return -EINVAL;
+
+	samples = kvmalloc_array(switches, sizeof(*samples), GFP_KERNEL);
+	if (!samples)
+		return -ENOMEM;
+
+	mutex_lock(&acer_bench_lock);
+	for (int path = 0; path < ACER_BENCH_SWITCH_NR; path++)
+		acer_bench_switch_run(path, switches, burst, samples);
+	mutex_unlock(&acer_bench_lock);
+
+	kvfree(samples);
+	return count;
+}
+
+static const struct file_operations acer_bench_profile_fops = {
+	.owner = THIS_MODULE,
+	.open = acer_bench_profile_open,
+	.read = seq_read,
+	.write = acer_bench_profile_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void acer_bench_init(void)
+{
+	if (!mock_backend)
+		return;
+
+	debugfs_create_file("bench", S_IRUSR | S_IWUSR, acer_debugfs_dir, NULL,
+			    &acer_bench_fops);
+	debugfs_create_file("bench_profile", S_IRUSR | S_IWUSR,
+			    acer_debugfs_dir, NULL, &acer_bench_profile_fops);
+}
+#else
+static inline void acer_bench_init(void) { }
+#endif
+
+/*
+ * The platform profile is registered from a work item so that a
+ * registration that keeps failing (e.g. while another profile
+ * handler is still being set up) never blocks the probe and with it
+ * module loading. Failed attempts are retried with exponential
+ * backoff.
+ */
+#define ACER_PLATFORM_PROFILE_MAX_RETRIES 10
+
+static struct platform_device *platform_profile_pdev;
+static int platform_profile_attempt;
+static unsigned int platform_profile_retry_ms;
+
+static void acer_platform_profile_register_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(platform_profile_work,
+			    acer_platform_profile_register_work);
+
+static void acer_platform_profile_register_work(struct work_struct *work)
+{
+	struct device *ppdev;
+
+	platform_profile_attempt++;
+	ppdev = devm_platform_profile_register(&platform_profile_pdev->dev,
+					       "acer-wmi-ext", NULL,
+					       &acer_platform_profile_ops);
+
+	if (!IS_ERR(ppdev)) {
+		platform_profile_device = ppdev;
+		WRITE_ONCE(platform_profile_support, true);
+		profile_register_time_us =
+			ktime_us_delta(ktime_get(), acer_load_start);
+		pr_info("Platform profile registered successfully (attempt %d, %u us after load)\n",
+			platform_profile_attempt, profile_register_time_us);
+		return;
 	}
 
-	pr_info("usb charging set value: %d\n", val);
-	usb_charge_mode_enable = val;
-	status = acer_wmi_apgeaction_exec_u64(ACER_WMID_SET_FUNCTION, input_value, &result);
+	pr_warn("Platform profile registration failed (attempt %d/%d), error: %ld\n",
+		platform_profile_attempt, ACER_PLATFORM_PROFILE_MAX_RETRIES,
+		PTR_ERR(ppdev));
 
-	if (ACPI_FAILURE(status)) {
-		pr_err("Error setting usb charging status: %s\n", acpi_format_exception(status));
-		return -ENODEV;
+	if (platform_profile_attempt >= ACER_PLATFORM_PROFILE_MAX_RETRIES) {
+		pr_err("Giving up on platform profile registration\n");
+		return;
 	}
 
-	pr_info("usb charging set status: %llu\n", result);
-	return count;
+	schedule_delayed_work(&platform_profile_work,
+			      msecs_to_jiffies(platform_profile_retry_ms));
+	platform_profile_retry_ms = min(platform_profile_retry_ms * 2, 1000);
 }
 
-static ssize_t usb_charge_limit_show(struct device_driver *driver, char *buf)
+static int acer_platform_profile_setup(struct platform_device *pdev)
 {
+	if (!quirks->system_control_mode) {
+		pr_info("System control mode quirk not enabled, skipping platform profile setup\n");
+		return 0;
+	}
 
-     acpi_status status;
-     u64 result;
-	 int ret;
+	pr_info("Setting up platform profile support\n");
 
-	 if (quirks->usb_charge_mode == 0) {
-		 pr_info("USB charging limit quirk not enabled, skipping show\n");
-		 return -EOPNOTSUPP;
-	 }
+	platform_profile_pdev = pdev;
+	platform_profile_attempt = 0;
+	platform_profile_retry_ms = 100;
+	schedule_delayed_work(&platform_profile_work, 0);
 
-     status = acer_wmi_apgeaction_exec_u64(ACER_WMID_GET_FUNCTION, 0x4, &result);
-     if (ACPI_FAILURE(status)) {
-         pr_err("Error getting usb charging limit: %s\n", acpi_format_exception(status));
-         return -ENODEV;
-     }
+	return 0;
+}
 
-     pr_info("usb charging get limit: %llu\n", result);
-	 switch (result) {
-		case 659200: // Set usb charging to 10%
-			ret = 10;
-			break;
-		case 1314560: // Set usb charging to 20%
-			ret = 20;
-			break;
-		case 1969920: // Set usb charging to 30%
-			ret = 30;
-			break;
-		default:
-			ret = -1; // Unknown value or off
-	 }
+/*
+ * Batch interface
+ *
+ * /dev/acer-wmi-ext applies several settings in one ordered pass
+ * through the command queue. Settings are validated before anything
+ * is written, unchanged settings are skipped, and the USB charging
+ * mode and limit are combined into a single firmware word. When a
+ * write fails, the settings already written are restored in reverse
+ * order. Batches are serialized against each other.
+ *
+ * The device can be opened read-only to map the state page; the batch
+ * ioctl needs it opened for writing.
+ */
+struct acer_batch_step {
+	enum acer_cmd_type type;
+	u64 value;
+	u64 old;
+	u32 fields;
+};
 
-     return sprintf(buf, "%d\n", ret); //-1 means unknown value
+static DEFINE_MUTEX(acer_batch_lock);
 
+static void acer_batch_set_result(struct acer_wmi_ext_batch *batch,
+				  unsigned long fields, int err)
+{
+	unsigned int i;
+
+	for_each_set_bit(i, &fields, ACER_WMI_EXT_FIELD_NR)
+		batch->result[i] = err;
 }
 
-static ssize_t usb_charge_limit_store(struct device_driver *driver,
-				      const char *buf, size_t count)
+/* Validate the batch and turn the settings that change into steps */
+static int acer_batch_plan(struct acer_wmi_ext_batch *batch,
+			   struct acer_batch_step *steps, int *nr)
 {
-	acpi_status status;
-	u64 result;
-	u64 input_value;
-	u8 val;
+	u32 usb_fields = ACER_WMI_EXT_F_USB_CHARGE_MODE |
+			 ACER_WMI_EXT_F_USB_CHARGE_LIMIT;
+	struct acer_usb_charge cur;
+	struct acer_state state;
+	int enable, limit;
+	int err = 0;
+
+	if (batch->fields & ACER_WMI_EXT_F_HEALTH_MODE) {
+		acer_state_get(&state);
+		if (state.batteries[0].health_mode < 0)
+			err = -EOPNOTSUPP;
+		else
+			err = acer_cache_get(ACER_CACHE_BATTERY_STATUS);
+		if (!err && batch->health_mode != 0 && batch->health_mode != 1)
+			err = -EINVAL;
+		if (err) {
+			acer_batch_set_result(batch, ACER_WMI_EXT_F_HEALTH_MODE, err);
+			return err;
+		}
 
-	if (quirks->usb_charge_mode == 0) {
-		pr_info("USB charging limit quirk not enabled, skipping store\n");
-		return -EOPNOTSUPP;
+		acer_state_get(&state);
+		if (batch->health_mode != state.batteries[0].health_mode)
+			steps[(*nr)++] = (struct acer_batch_step) {
+				ACER_CMD_HEALTH_MODE, batch->health_mode,
+				state.batteries[0].health_mode,
+				ACER_WMI_EXT_F_HEALTH_MODE,
+			};
 	}
 
-	// Ensure current value isn't 'off'
-	if (usb_charge_mode_enable == 0) {
-		pr_err("USB charging is off, cannot set limit\n");
-		return -EINVAL;
+	if (batch->fields & usb_fields) {
+		if (!quirks->usb_charge_mode)
+			err = -EOPNOTSUPP;
+		else
+			err = acer_cache_get(ACER_CACHE_USB_CHARGE);
+
+		acer_state_get(&state);
+		cur = usb_charge_decode(state.usb_charge_status);
+		/* Without the current setting there is nothing to roll back to */
+		if (!err && cur.enable < 0)
+			err = -EIO;
+
+		enable = batch->fields & ACER_WMI_EXT_F_USB_CHARGE_MODE ?
+			 batch->usb_charge_mode : cur.enable;
+		if (batch->fields & ACER_WMI_EXT_F_USB_CHARGE_LIMIT)
+			limit = batch->usb_charge_limit;
+		else
+			limit = cur.enable > 0 ? cur.limit :
+						 ACER_USB_CHARGE_LIMIT_DEFAULT;
+
+		if (!err && enable != 0 && enable != 1)
+			err = -EINVAL;
+		if (!err && enable == 0 &&
+		    (batch->fields & ACER_WMI_EXT_F_USB_CHARGE_LIMIT))
+			err = -EINVAL;
+		if (!err && enable && !usb_charge_limit_valid(limit))
+			err = -EINVAL;
+		if (err) {
+			acer_batch_set_result(batch, batch->fields & usb_fields, err);
+			return err;
+		}
+
+		if (!enable)
+			limit = ACER_USB_CHARGE_LIMIT_OFF;
+		if (enable != cur.enable || limit != cur.limit)
+			steps[(*nr)++] = (struct acer_batch_step) {
+				ACER_CMD_USB_CHARGE,
+				usb_charge_encode(enable, limit),
+				usb_charge_encode(cur.enable, cur.limit),
+				batch->fields & usb_fields,
+			};
 	}
 
-	if (sscanf(buf, "%hhd", &val) != 1)
+	if (batch->fields & ACER_WMI_EXT_F_SYSTEM_CONTROL_MODE) {
+		acer_control_mode_sync();
+		acer_state_get(&state);
+		if (!quirks->system_control_mode || state.control_mode < 0)
+			err = -EOPNOTSUPP;
+		else if (batch->system_control_mode < SYSTEM_CONTROL_BALANCED ||
+			 batch->system_control_mode > SYSTEM_CONTROL_PERFORMANCE)
+			err = -EINVAL;
+		if (err) {
+			acer_batch_set_result(batch,
+					      ACER_WMI_EXT_F_SYSTEM_CONTROL_MODE, err);
+			return err;
+		}
+
+		if (batch->system_control_mode != state.control_mode)
+			steps[(*nr)++] = (struct acer_batch_step) {
+				ACER_CMD_CONTROL_MODE,
+				batch->system_control_mode, state.control_mode,
+				ACER_WMI_EXT_F_SYSTEM_CONTROL_MODE,
+			};
+	}
+
+	return 0;
+}
+
+static int acer_batch_apply(struct acer_wmi_ext_batch *batch)
+{
+	struct acer_batch_step steps[3];
+	int nr = 0, i;
+	int err;
+
+	batch->applied = 0;
+	batch->rolled_back = 0;
+	memset(batch->result, 0, sizeof(batch->result));
+
+	if (batch->fields & ~ACER_WMI_EXT_F_ALL)
 		return -EINVAL;
 
-	switch (val) {
-	case 10:
-		input_value = 659204; // Set usb charging to 10%
-		break;
-	case 20:
-		input_value = 1314564; // Set usb charging to 20%
-		break;
-	case 30:
-		input_value = 1969924; // Set usb charging to 30%
-		break;
+	mutex_lock(&acer_batch_lock);
+
+	err = acer_batch_plan(batch, steps, &nr);
+	if (err)
+		goto out;
+
+	for (i = 0; i < nr; i++) {
+		err = acer_cmd_submit(steps[i].type, steps[i].value, true);
+		acer_batch_set_result(batch, steps[i].fields, err);
+		if (err)
+			break;
+		batch->applied |= steps[i].fields;
+	}
+	if (!err)
+		goto out;
+
+	/* A write that timed out may still reach the firmware: undo it too */
+	if (err == -ETIMEDOUT)
+		i++;
+	while (i-- > 0) {
+		if (acer_cmd_submit(steps[i].type, steps[i].old, true))
+			pr_err_ratelimited("Failed to roll back firmware command %d\n",
+					   steps[i].type);
+		else
+			batch->rolled_back |= steps[i].fields;
+	}
+
+out:
+	mutex_unlock(&acer_batch_lock);
+	return err;
+}
+
+static long acer_misc_ioctl(struct file *file, unsigned int cmd,
+			    unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+	struct acer_wmi_ext_batch batch;
+	int err;
+
+	switch (cmd) {
+	case ACER_WMI_EXT_IOC_SET_BATCH:
+		if (!(file->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&batch, argp, sizeof(batch)))
+			return -EFAULT;
+
+		err = acer_batch_apply(&batch);
+
+		if (copy_to_user(argp, &batch, sizeof(batch)))
+			return -EFAULT;
+		return err;
+
 	default:
-		pr_err("Unknown usb charging limit value: %d\n", val);
-		return -EINVAL;
+		return -ENOTTY;
 	}
+}
 
-	pr_info("usb charging set limit value: %d\n", val);
-	status = acer_wmi_apgeaction_exec_u64(ACER_WMID_SET_FUNCTION, input_value, &result);
+static int acer_misc_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
 
-	if (ACPI_FAILURE(status)) {
-		pr_err("Error setting usb charging limit: %s\n", acpi_format_exception(status));
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vm_flags_clear(vma, VM_MAYWRITE);
+
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(acer_state_page));
+}
+
+static const struct file_operations acer_misc_fops = {
+	.owner = THIS_MODULE,
+	.mmap = acer_misc_mmap,
+	.unlocked_ioctl = acer_misc_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.llseek = noop_llseek,
+};
+
+static struct miscdevice acer_misc_device = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "acer-wmi-ext",
+	.fops = &acer_misc_fops,
+	.mode = 0644,
+};
+
+/*
+ * Mode hotkey
+ *
+ * With mode_hotkey set, the key is taken from the acer-wmi hotkeys
+ * input device before it reaches userspace. Each press moves the fan
+ * mode to the next one in the order Balanced, Quiet, Performance with
+ * a single EC write, after which platform profile listeners are
+ * notified.
+ */
+#define ACER_HOTKEY_INPUT_NAME "Acer WMI hotkeys"
+
+static void acer_hotkey_work_fn(struct work_struct *work)
+{
+	static const u8 next_mode[] = {
+		[SYSTEM_CONTROL_BALANCED] = SYSTEM_CONTROL_SILENT,
+		[SYSTEM_CONTROL_SILENT] = SYSTEM_CONTROL_PERFORMANCE,
+		[SYSTEM_CONTROL_PERFORMANCE] = SYSTEM_CONTROL_BALANCED,
+	};
+	short mode = acer_control_mode_target();
+	u8 next;
+
+	if (mode < SYSTEM_CONTROL_BALANCED || mode > SYSTEM_CONTROL_PERFORMANCE)
+		mode = SYSTEM_CONTROL_PERFORMANCE;
+	next = next_mode[mode];
+
+	if (acer_cmd_submit(ACER_CMD_CONTROL_MODE, next, true))
+		return;
+
+	if (READ_ONCE(platform_profile_support))
+		platform_profile_notify(platform_profile_device);
+}
+
+static DECLARE_WORK(acer_hotkey_work, acer_hotkey_work_fn);
+
+/* Called with the input device's event lock held */
+static bool acer_hotkey_filter(struct input_handle *handle, unsigned int type,
+			       unsigned int code, int value)
+{
+	if (type != EV_KEY || code != mode_hotkey)
+		return false;
+
+	if (value == 1)
+		schedule_work(&acer_hotkey_work);
+
+	return true;
+}
+
+static int acer_hotkey_connect(struct input_handler *handler,
+			       struct input_dev *dev,
+			       const struct input_device_id *id)
+{
+	struct input_handle *handle;
+	int err;
+
+	if (!dev->name || strcmp(dev->name, ACER_HOTKEY_INPUT_NAME) ||
+	    !test_bit(mode_hotkey, dev->keybit))
 		return -ENODEV;
-	}
 
-	pr_info("usb charging set limit: %llu\n", result);
-	return count;
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = "acer-wmi-ext";
+
+	err = input_register_handle(handle);
+	if (err)
+		goto error_free;
+
+	err = input_open_device(handle);
+	if (err)
+		goto error_unregister;
+
+	pr_info("Handling mode key %u of %s\n", mode_hotkey, dev->name);
+	return 0;
+
+error_unregister:
+	input_unregister_handle(handle);
+error_free:
+	kfree(handle);
+	return err;
+}
+
+static void acer_hotkey_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
 }
 
-static DRIVER_ATTR_RW(health_mode);
-static DRIVER_ATTR_RW(calibration_mode);
-static DRIVER_ATTR_RW(system_control_mode);
-static DRIVER_ATTR_RW(usb_charge_mode);
-static DRIVER_ATTR_RW(usb_charge_limit);
+static const struct input_device_id acer_hotkey_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT,
+		.evbit = { BIT_MASK(EV_KEY) },
+	},
+	{ },
+};
 
-static struct attribute *acer_wmi_ext_attrs[] = {
-	&driver_attr_health_mode.attr, &driver_attr_calibration_mode.attr, &driver_attr_system_control_mode.attr, &driver_attr_usb_charge_mode.attr, &driver_attr_usb_charge_limit.attr, NULL
+static struct input_handler acer_hotkey_handler = {
+	.filter = acer_hotkey_filter,
+	.connect = acer_hotkey_connect,
+	.disconnect = acer_hotkey_disconnect,
+	.name = "acer-wmi-ext",
+	.id_table = acer_hotkey_ids,
 };
 
-ATTRIBUTE_GROUPS(acer_wmi_ext);
+static bool acer_hotkey_registered;
 
-static const struct wmi_device_id acer_wmi_ext_id_table[] = {
-	{ .guid_string = WMI_GUID1 },
-	{},
-};
+static void acer_hotkey_init(void)
+{
+	if (!mode_hotkey || !quirks->system_control_mode)
+		return;
 
-static struct wmi_driver acer_wmi_ext_driver = {
-	.driver = { .name = "acer-wmi-ext",
-		    .groups = acer_wmi_ext_groups },
-};
+	if (mode_hotkey > KEY_MAX) {
+		pr_err("Invalid mode hotkey: %u\n", mode_hotkey);
+		return;
+	}
 
-static int system_control_mode_inited = 0;
-static int
-acer_system_control_mode_init(void)
+	if (input_register_handler(&acer_hotkey_handler)) {
+		pr_warn("Unable to register the mode hotkey handler\n");
+		return;
+	}
+	acer_hotkey_registered = true;
+}
+
+static void acer_hotkey_exit(void)
 {
-	u8 tp;
+	if (!acer_hotkey_registered)
+		return;
+
+	input_unregister_handler(&acer_hotkey_handler);
+	cancel_work_sync(&acer_hotkey_work);
+}
+
+/*
+ * Sensors
+ *
+ * Fan speeds and EC temperatures are served from a copy of the EC
+ * registers that hold them. The copy is refreshed with one burst read
+ * of all the registers at most once per update interval, however many
+ * readers there are. The register layouts have not been confirmed on
+ * hardware, so the sensors are only registered with hwmon_sensors=1.
+ */
+struct acer_sensors_cache {
+	u16 fan_rpm[ACER_EC_SENSORS_MAX_FANS];
+	u8 temp[ACER_EC_SENSORS_MAX_TEMPS];
+	unsigned long updated;
+	bool valid;
 	int err;
+};
 
-	system_control_mode_inited = 1;
+static DEFINE_MUTEX(acer_sensors_lock);
+static struct acer_sensors_cache acer_sensors;
+static unsigned int acer_sensors_interval_ms = 1000;
 
-	err = ec_read(ACER_SYSTEM_CONTROL_MODE_EC_OFFSET, &tp);
-	if (err < 0) {
-		pr_err("Failed to read system control mode from EC: %d\n", err);
-		return err;
-	}
+#define ACER_SENSORS_MAX_REGS \
+	(2 * ACER_EC_SENSORS_MAX_FANS + ACER_EC_SENSORS_MAX_TEMPS)
 
-	pr_err("System control mode: %d\n", tp);
-	control_mode = tp;
-
-	if (enable_system_control_mode >= 0) {
-		if (enable_system_control_mode < SYSTEM_CONTROL_BALANCED ||
-		    enable_system_control_mode > SYSTEM_CONTROL_PERFORMANCE) {
-			pr_err("Invalid system control mode value: %d\n",
-			       enable_system_control_mode);
-			return -EINVAL;
-		}
+static int acer_sensors_refresh(const struct acer_ec_sensors *layout)
+{
+	u8 offsets[ACER_SENSORS_MAX_REGS], values[ACER_SENSORS_MAX_REGS];
+	unsigned int n = 0;
+	int i, err;
 
-		pr_info("Setting system control mode to %d\n",
-			enable_system_control_mode);
+	lockdep_assert_held(&acer_sensors_lock);
 
-		err = ec_write(ACER_SYSTEM_CONTROL_MODE_EC_OFFSET,
-			       enable_system_control_mode);
-		if (err < 0) {
-			pr_err("Failed to write system control mode to EC: %d\n",
-			       err);
-			return err;
-		}
+	if (acer_sensors.valid &&
+	    time_before(jiffies, acer_sensors.updated +
+			msecs_to_jiffies(acer_sensors_interval_ms)))
+		return acer_sensors.err;
 
-		control_mode = enable_system_control_mode;
-		pr_info("System control mode set to %d\n", control_mode);
+	for (i = 0; i < layout->nr_fans; i++) {
+		offsets[n++] = layout->fan_rpm[i];
+		offsets[n++] = layout->fan_rpm[i] + 1;
+	}
+	for (i = 0; i < layout->nr_temps; i++)
+		offsets[n++] = layout->temp[i];
+
+	err = acer_ec_read_burst(offsets, values, n);
+	if (!err) {
+		for (i = 0; i < layout->nr_fans; i++)
+			acer_sensors.fan_rpm[i] = values[2 * i] |
+						  values[2 * i + 1] << 8;
+		for (i = 0; i < layout->nr_temps; i++)
+			acer_sensors.temp[i] = values[2 * layout->nr_fans + i];
 	}
 
-	return 0;
+	/* Failures are cached too, the EC is not retried before the interval ends */
+	acer_sensors.updated = jiffies;
+	acer_sensors.valid = true;
+	acer_sensors.err = err;
+	return err;
 }
 
-/*
- * Platform profile support
- */
-static struct device *platform_profile_device;
-static bool platform_profile_support;
+static umode_t acer_hwmon_is_visible(const void *data,
+				     enum hwmon_sensor_types type,
+				     u32 attr, int channel)
+{
+	const struct acer_ec_sensors *layout = data;
+
+	switch (type) {
+	case hwmon_chip:
+		return 0644;
+	case hwmon_fan:
+		return channel < layout->nr_fans ? 0444 : 0;
+	case hwmon_temp:
+		return channel < layout->nr_temps ? 0444 : 0;
+	default:
+		return 0;
+	}
+}
 
-static int
-acer_platform_profile_probe(void *drvdata, unsigned long *choices)
+static int acer_hwmon_read(struct device *dev, enum hwmon_sensor_types type,
+			   u32 attr, int channel, long *val)
 {
+	const struct acer_ec_sensors *layout = quirks->sensors;
 	int err;
 
-	if (!quirks->system_control_mode) {
-		pr_info("System control mode quirk not enabled, skipping platform profile probe\n");
-		return -EOPNOTSUPP;
+	if (type == hwmon_chip) {
+		*val = READ_ONCE(acer_sensors_interval_ms);
+		return 0;
 	}
 
-	// Initialize the system control mode if it hasn't been done yet
-	if (!system_control_mode_inited) {
-		err = acer_system_control_mode_init();
-		if (err)
-			return err;
+	mutex_lock(&acer_sensors_lock);
+	err = acer_sensors_refresh(layout);
+	if (!err) {
+		if (type == hwmon_fan)
+			*val = acer_sensors.fan_rpm[channel];
+		else
+			*val = acer_sensors.temp[channel] * 1000;
 	}
+	mutex_unlock(&acer_sensors_lock);
 
-	// Add choices for platform profiles
-    set_bit(PLATFORM_PROFILE_LOW_POWER, choices);
-	set_bit(PLATFORM_PROFILE_BALANCED, choices);
-	set_bit(PLATFORM_PROFILE_PERFORMANCE, choices);
+	return err;
+}
 
+static int acer_hwmon_read_string(struct device *dev,
+				  enum hwmon_sensor_types type,
+				  u32 attr, int channel, const char **str)
+{
+	*str = quirks->sensors->temp_label[channel];
 	return 0;
 }
 
-static int
-acer_platform_profile_get(struct device *dev,
-					enum platform_profile_option *profile)
+static int acer_hwmon_write(struct device *dev, enum hwmon_sensor_types type,
+			    u32 attr, int channel, long val)
 {
-	switch (control_mode) {
-	case SYSTEM_CONTROL_BALANCED:
-		*profile = PLATFORM_PROFILE_BALANCED;
-		break;
-	case SYSTEM_CONTROL_PERFORMANCE:
-		*profile = PLATFORM_PROFILE_PERFORMANCE;
-		break;
-	case SYSTEM_CONTROL_SILENT:
-		*profile = PLATFORM_PROFILE_LOW_POWER;
-		break;
-	default:
+	if (type != hwmon_chip || attr != hwmon_chip_update_interval)
 		return -EOPNOTSUPP;
-	}
 
+	WRITE_ONCE(acer_sensors_interval_ms, clamp_val(val, 100, 60000));
 	return 0;
 }
 
-static int
-acer_platform_profile_set(struct device *dev,
-					enum platform_profile_option profile)
-{
-	int err;
-	if (!quirks->system_control_mode) {
-		pr_info("System control mode quirk not enabled, skipping platform profile set\n");
-		return -EOPNOTSUPP;
-	}
+static const struct hwmon_ops acer_hwmon_ops = {
+	.is_visible = acer_hwmon_is_visible,
+	.read = acer_hwmon_read,
+	.read_string = acer_hwmon_read_string,
+	.write = acer_hwmon_write,
+};
 
-	int new_mode;
-	switch (profile) {
-	case PLATFORM_PROFILE_BALANCED:
-		new_mode = SYSTEM_CONTROL_BALANCED;
-		break;
-	case PLATFORM_PROFILE_PERFORMANCE:
-		new_mode = SYSTEM_CONTROL_PERFORMANCE;
-		break;
-	case PLATFORM_PROFILE_LOW_POWER:
-		new_mode = SYSTEM_CONTROL_SILENT;
-		break;
-	default:
-		pr_err("Unsupported platform profile option: %d\n", profile);
-		return -EOPNOTSUPP;
-	}
+static const struct hwmon_channel_info * const acer_hwmon_info[] = {
+	HWMON_CHANNEL_INFO(chip, HWMON_C_UPDATE_INTERVAL),
+	HWMON_CHANNEL_INFO(fan, HWMON_F_INPUT, HWMON_F_INPUT),
+	HWMON_CHANNEL_INFO(temp,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL,
+			   HWMON_T_INPUT | HWMON_T_LABEL),
+	NULL
+};
 
-	if (new_mode == control_mode) {
-		pr_info("Platform profile already set to %d, no change needed\n",
-			new_mode);
+static const struct hwmon_chip_info acer_hwmon_chip_info = {
+	.ops = &acer_hwmon_ops,
+	.info = acer_hwmon_info,
+};
+
+static int acer_hwmon_setup(struct platform_device *pdev)
+{
+	struct device *hwmon;
+
+	if (!quirks->sensors || !hwmon_sensors)
 		return 0;
-	}
 
-	pr_info("Setting platform profile to %d\n", new_mode);
-	err = ec_write(ACER_SYSTEM_CONTROL_MODE_EC_OFFSET, new_mode);
-	if (err < 0) {
-		pr_err("Failed to set platform profile: %d\n", err);
-		return err;
+	hwmon = devm_hwmon_device_register_with_info(&pdev->dev, "acer_wmi_ext",
+						     (void *)quirks->sensors,
+						     &acer_hwmon_chip_info, NULL);
+	if (IS_ERR(hwmon)) {
+		pr_err("Unable to register hwmon device\n");
+		return PTR_ERR(hwmon);
 	}
 
-	control_mode = new_mode;
-	pr_info("Platform profile set to %d\n", control_mode);
-
 	return 0;
 }
- 
 
-static const struct platform_profile_ops acer_platform_profile_ops = {
-	.probe = acer_platform_profile_probe,
-	.profile_get = acer_platform_profile_get,
-	.profile_set = acer_platform_profile_set,
+/*
+ * Platform device
+ */
+#ifdef CONFIG_PM_SLEEP
+/*
+ * Some firmware resets the fan mode and the USB charging settings
+ * across suspend. The settings in effect are recorded at suspend and
+ * compared against the hardware by a work item after resume, which
+ * rewrites only the settings that differ. A setting that was written
+ * after resume, e.g. by the user before the work item ran, is newer
+ * than the recorded one and is left alone. The resume callback itself
+ * only invalidates what the driver knows about the firmware.
+ */
+struct acer_pm_stats {
+	u64 suspend_ns;
+	u64 resume_ns;
+	u64 reconcile_ns;
+	unsigned int reconcile_writes;
+	unsigned int reconcile_failures;
+	unsigned int reconcile_skipped;
 };
 
-static int acer_platform_profile_setup(struct platform_device *pdev)
+static struct acer_state acer_suspend_state;
+static u64 acer_resume_ticket;
+static struct acer_pm_stats acer_pm_stats;
+
+/* Restore a setting unless it was written since resume */
+static int acer_ext_restore(enum acer_cmd_type type, u64 value,
+			    unsigned int *writes, unsigned int *failures,
+			    unsigned int *skipped)
 {
-	const int max_retries = 10;
-	int delay_ms = 100;
-	if (!quirks->system_control_mode) {
-		pr_info("System control mode quirk not enabled, skipping platform profile setup\n");
-		return 0;
+	int err;
+
+	err = __acer_cmd_submit(type, value, true, acer_resume_ticket);
+	if (err == -EBUSY) {
+		pr_info("Skipped restoring command %d, it was written after resume\n",
+			type);
+		(*skipped)++;
+		return err;
 	}
 
-	pr_info("Setting up platform profile support\n");
+	(*writes)++;
+	if (err)
+		(*failures)++;
+	return err;
+}
 
-	for (int attempt = 1; attempt <= max_retries; attempt++) {
-		platform_profile_device = devm_platform_profile_register(
-			&pdev->dev, "acer-wmi-ext", NULL, &acer_platform_profile_ops);
+static void acer_ext_reconcile(struct work_struct *work)
+{
+	struct acer_state desired = acer_suspend_state;
+	struct acer_usb_charge uc;
+	struct acer_state state;
+	u64 start = ktime_get_ns();
+	unsigned int writes = 0, failures = 0, skipped = 0;
+	int health_mode;
+	u8 mode;
+
+	if (quirks->system_control_mode &&
+	    desired.control_mode >= SYSTEM_CONTROL_BALANCED &&
+	    !acer_ec_shadow_read(ACER_EC_SYSTEM_CONTROL_MODE, &mode) &&
+	    mode != desired.control_mode) {
+		pr_info("Restoring system control mode %d (firmware reset it to %d)\n",
+			desired.control_mode, mode);
+		acer_ext_restore(ACER_CMD_CONTROL_MODE, desired.control_mode,
+				 &writes, &failures, &skipped);
+	}
 
-		if (!IS_ERR(platform_profile_device)) {
-			platform_profile_support = true;
-			pr_info("Platform profile registered successfully (attempt %d)\n", attempt);
-			return 0;
+	if (quirks->usb_charge_mode &&
+	    usb_charge_decode(desired.usb_charge_status).enable >= 0 &&
+	    !acer_cache_refresh(ACER_CACHE_USB_CHARGE)) {
+		acer_state_get(&state);
+		if (state.usb_charge_status != desired.usb_charge_status) {
+			pr_info("Restoring usb charging status %llu (firmware reset it to %llu)\n",
+				desired.usb_charge_status, state.usb_charge_status);
+			uc = usb_charge_decode(desired.usb_charge_status);
+			acer_ext_restore(ACER_CMD_USB_CHARGE,
+					 usb_charge_encode(uc.enable, uc.limit),
+					 &writes, &failures, &skipped);
 		}
+	}
 
-		pr_warn("Platform profile registration failed (attempt %d/%d), error: %ld\n",
-				attempt, max_retries, PTR_ERR(platform_profile_device));
-
-		if (attempt < max_retries) {
-			msleep(delay_ms);
-			delay_ms = min(delay_ms * 2, 1000);
-		}
+	/* One refresh reads all batteries */
+	if (desired.batteries[0].health_mode >= 0)
+		update_state();
+	acer_state_get(&state);
+	for (unsigned int bat = 0; bat < acer_nr_batteries; bat++) {
+		health_mode = desired.batteries[bat].health_mode;
+		if (health_mode < 0 || state.batteries[bat].health_mode < 0 ||
+		    state.batteries[bat].health_mode == health_mode)
+			continue;
+
+		pr_info("Restoring health mode %d of battery %u\n",
+			health_mode, bat + 1);
+		acer_ext_restore(acer_battery_cmd(bat, ACER_ATTR_HEALTH_MODE),
+				 health_mode, &writes, &failures, &skipped);
 	}
 
-	return PTR_ERR(platform_profile_device);
+	acer_pm_stats.reconcile_ns = ktime_get_ns() - start;
+	acer_pm_stats.reconcile_writes = writes;
+	acer_pm_stats.reconcile_failures = failures;
+	acer_pm_stats.reconcile_skipped = skipped;
 }
 
-/*
- * Platform device
- */
-#ifdef CONFIG_PM_SLEEP
+static DECLARE_WORK(acer_ext_reconcile_work, acer_ext_reconcile);
+
 static int acer_ext_suspend(struct device *dev)
 {
+	u64 start = ktime_get_ns();
+
+	/* Settings still being applied are part of what gets restored */
+	cancel_work_sync(&acer_ext_reconcile_work);
+	flush_work(&acer_cmd_work);
+	acer_state_get(&acer_suspend_state);
+
+	acer_pm_stats.suspend_ns = ktime_get_ns() - start;
 	return 0;
 }
 
 static int acer_ext_resume(struct device *dev)
 {
+	u64 start = ktime_get_ns();
+
+	/* The firmware may have changed EC registers while we slept */
+	acer_ec_shadow_invalidate_all();
+	acer_cache_invalidate_all();
+	acer_resume_ticket = acer_cmd_ticket();
+	queue_work(system_unbound_wq, &acer_ext_reconcile_work);
+
+	acer_pm_stats.resume_ns = ktime_get_ns() - start;
+	return 0;
+}
+
+static int acer_pm_stats_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "suspend_ns: %llu\n", acer_pm_stats.suspend_ns);
+	seq_printf(m, "resume_ns: %llu\n", acer_pm_stats.resume_ns);
+	seq_printf(m, "reconcile_ns: %llu\n", acer_pm_stats.reconcile_ns);
+	seq_printf(m, "reconcile_writes: %u\n", acer_pm_stats.reconcile_writes);
+	seq_printf(m, "reconcile_failures: %u\n",
+		   acer_pm_stats.reconcile_failures);
+	seq_printf(m, "reconcile_skipped: %u\n",
+		   acer_pm_stats.reconcile_skipped);
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(acer_pm_stats);
+
+static void acer_pm_init(void)
+{
+	debugfs_create_file("pm", S_IRUSR, acer_debugfs_dir, NULL,
+			    &acer_pm_stats_fops);
+}
+
+static void acer_pm_exit(void)
+{
+	cancel_work_sync(&acer_ext_reconcile_work);
+}
 #else
+static inline void acer_pm_init(void) { }
+static inline void acer_pm_exit(void) { }
+
 #define acer_ext_suspend	NULL
 #define acer_ext_resume	NULL
 #endif
@@ -833,22 +4382,36 @@ static int acer_ext_platform_probe(struct platform_device *device)
 	if (err)
 		return err;
 
+	err = acer_hwmon_setup(device);
+	if (err)
+		return err;
+
 	return 0;
 }
 
 static void acer_ext_platform_remove(struct platform_device *device)
 {
+	cancel_delayed_work_sync(&platform_profile_work);
+
+	/* The profile device goes with the devres of this device. Stop
+	   notifying it, and let a command that may already be doing so
+	   finish before it is freed. */
+	WRITE_ONCE(platform_profile_support, false);
+	flush_work(&acer_cmd_work);
+	platform_profile_device = NULL;
+
+	acer_pm_exit();
 }
 
 static void acer_ext_platform_shutdown(struct platform_device *device)
 {
 }
 
-static struct platform_device *acer_ext_platform_device;
 static struct platform_driver acer_ext_platform_driver = {
 	.driver = {
 		.name = "acer-wmi-ext",
 		.pm = &acer_ext_pm,
+		.probe_type = PROBE_PREFER_ASYNCHRONOUS,
 	},
 	.probe = acer_ext_platform_probe,
 	.remove = acer_ext_platform_remove,
@@ -856,39 +4419,207 @@ static struct platform_driver acer_ext_platform_driver = {
 };
  
 
-static int __init acer_wmi_ext_init(void)
+/*
+ * Module initialization
+ *
+ * The battery, system control mode and USB charging probes use
+ * separate firmware interfaces and do not depend on each other, so
+ * they run concurrently in an async domain of the driver. The
+ * attributes only go live once all of them have finished, and a load
+ * costs about as much as the slowest probe. The probes only read the
+ * firmware; the health and control mode parameters are written after
+ * all of them finished, and only if the battery probe succeeded, so a
+ * failed load leaves the firmware untouched. The time every phase
+ * took is traced and can be read from debugfs.
+ */
+enum acer_init_phase {
+	ACER_INIT_QUIRKS,
+	ACER_INIT_BATTERY,
+	ACER_INIT_CONTROL_MODE,
+	ACER_INIT_USB_CHARGE,
+	ACER_INIT_PROBES,
+	ACER_INIT_PARAMS,
+	ACER_INIT_REGISTER,
+	ACER_INIT_NR,
+};
+
+static const char * const acer_init_phase_names[ACER_INIT_NR] = {
+	[ACER_INIT_QUIRKS] = "quirks",
+	[ACER_INIT_BATTERY] = "battery",
+	[ACER_INIT_CONTROL_MODE] = "control_mode",
+	[ACER_INIT_USB_CHARGE] = "usb_charge",
+	[ACER_INIT_PROBES] = "probes",
+	[ACER_INIT_PARAMS] = "params",
+	[ACER_INIT_REGISTER] = "register",
+};
+
+/* Start times are relative to the module load */
+static struct {
+	u64 start_ns;
+	u64 duration_ns;
+	int result;
+	bool done;
+} acer_init_phases[ACER_INIT_NR];
+
+static ASYNC_DOMAIN_EXCLUSIVE(acer_init_domain);
+
+static void acer_init_phase_begin(enum acer_init_phase phase)
 {
-	int err;
-    find_quirks();
+	acer_init_phases[phase].start_ns =
+		ktime_to_ns(ktime_sub(ktime_get(), acer_load_start));
+}
 
-	if (wmi_has_guid(WMI_GUID1)) {
-		if (enable_health_mode >= 0) {
-			acpi_status status;
-			status = set_battery_health_control(HEALTH_MODE,
-								enable_health_mode);
+static void acer_init_phase_end(enum acer_init_phase phase, int result)
+{
+	u64 now = ktime_to_ns(ktime_sub(ktime_get(), acer_load_start));
+
+	acer_init_phases[phase].duration_ns = now - acer_init_phases[phase].start_ns;
+	acer_init_phases[phase].result = result;
+	acer_init_phases[phase].done = true;
+	trace_acer_wmi_ext_init_phase(acer_init_phase_names[phase],
+				      acer_init_phases[phase].start_ns,
+				      acer_init_phases[phase].duration_ns,
+				      result);
+}
 
-			if (ACPI_FAILURE(status))
-				return -EIO;
-		}
+static int acer_init_phases_show(struct seq_file *m, void *v)
+{
+	for (int phase = 0; phase < ACER_INIT_NR; phase++) {
+		if (!acer_init_phases[phase].done)
+			continue;
+		seq_printf(m, "%-12s start_us: %8llu duration_us: %8llu result: %d\n",
+			   acer_init_phase_names[phase],
+			   div_u64(acer_init_phases[phase].start_ns, NSEC_PER_USEC),
+			   div_u64(acer_init_phases[phase].duration_ns, NSEC_PER_USEC),
+			   acer_init_phases[phase].result);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(acer_init_phases);
 
-		if (ACPI_FAILURE(init_state()))
-			return -EIO;
-	} else {
+static int acer_init_battery(void)
+{
+	if (!acer_fw->wmi_has_guid(WMI_GUID1)) {
 		pr_info("Acer battery control guid not found\n");
+		return 0;
 	}
-	
-	if (quirks->system_control_mode) {
-		acer_system_control_mode_init();
+
+	if (ACPI_FAILURE(init_state()))
+		return -EIO;
+
+	return 0;
+}
+
+static void acer_init_probe(void *data, async_cookie_t cookie)
+{
+	enum acer_init_phase phase = (uintptr_t)data;
+	int err = 0;
+
+	acer_init_phase_begin(phase);
+	switch (phase) {
+	case ACER_INIT_BATTERY:
+		err = acer_init_battery();
+		break;
+	case ACER_INIT_CONTROL_MODE:
+		if (quirks->system_control_mode)
+			err = acer_system_control_mode_init();
+		break;
+	case ACER_INIT_USB_CHARGE:
+		if (quirks->usb_charge_mode)
+			init_usb_charge_mode();
+		break;
+	default:
+		break;
 	}
+	acer_init_phase_end(phase, err);
+}
 
-	if (quirks->usb_charge_mode) {
-		init_usb_charge_mode();
+/*
+ * Run the firmware probes and wait for them. Only a failed battery
+ * probe fails the load; the other features log their errors and stay
+ * unavailable.
+ */
+static int acer_init_probes(void)
+{
+	int err;
+
+	acer_init_phase_begin(ACER_INIT_PROBES);
+	for (int phase = ACER_INIT_BATTERY; phase <= ACER_INIT_USB_CHARGE; phase++)
+		async_schedule_domain(acer_init_probe, (void *)(uintptr_t)phase,
+				      &acer_init_domain);
+	async_synchronize_full_domain(&acer_init_domain);
+
+	err = acer_init_phases[ACER_INIT_BATTERY].result;
+	acer_init_phase_end(ACER_INIT_PROBES, err);
+	return err;
+}
+
+/*
+ * Apply the module parameters that write to the firmware. A failed
+ * health mode write fails the load; a failed control mode write is
+ * logged and leaves the mode as the firmware had it.
+ */
+static int acer_init_params(void)
+{
+	int err = 0;
+
+	acer_init_phase_begin(ACER_INIT_PARAMS);
+	if (enable_health_mode >= 0 && acer_fw->wmi_has_guid(WMI_GUID1))
+		err = acer_cmd_submit(ACER_CMD_HEALTH_MODE,
+				      enable_health_mode > 0, true);
+	if (!err && quirks->system_control_mode &&
+	    !acer_init_phases[ACER_INIT_CONTROL_MODE].result)
+		acer_system_control_mode_apply();
+	acer_init_phase_end(ACER_INIT_PARAMS, err);
+	return err;
+}
+
+static int __init acer_wmi_ext_init(void)
+{
+	int err;
+
+	acer_load_start = ktime_get();
+	err = acer_state_page_init();
+	if (err)
+		return err;
+	err = acer_genl_init();
+	if (err) {
+		acer_state_page_exit();
+		return err;
+	}
+	acer_debugfs_init();
+	debugfs_create_file("init", S_IRUSR, acer_debugfs_dir, NULL,
+			    &acer_init_phases_fops);
+	acer_mock_init(acer_debugfs_dir);
+	acer_init_phase_begin(ACER_INIT_QUIRKS);
+	find_quirks();
+	acer_init_phase_end(ACER_INIT_QUIRKS, 0);
+	err = acer_cache_init();
+	if (err)
+		goto error_debugfs;
+
+	err = acer_cmd_init();
+	if (err) {
+		acer_cache_exit();
+		goto error_debugfs;
 	}
+	acer_bench_init();
+	acer_pm_init();
+	acer_calib_init();
+
+	err = acer_init_probes();
+	if (err)
+		goto error_cmd;
+
+	err = acer_init_params();
+	if (err)
+		goto error_cmd;
 
+	acer_init_phase_begin(ACER_INIT_REGISTER);
 	err = platform_driver_register(&acer_ext_platform_driver);
 	if (err) {
 		pr_err("Unable to register platform driver\n");
-		goto error_platform_register;
+		goto error_cmd;
 	}
 
 	acer_ext_platform_device = platform_device_alloc("acer-wmi-ext", PLATFORM_DEVID_NONE);
@@ -896,29 +4627,75 @@ static int __init acer_wmi_ext_init(void)
 		err = -ENOMEM;
 		goto error_device_alloc;
 	}
+	acer_battery_sysfs_init();
+	acer_ext_platform_device->dev.groups = acer_wmi_ext_groups;
 
 	err = platform_device_add(acer_ext_platform_device);
 	if (err)
 		goto error_device_add;
+	acer_sysfs_notify_init(&acer_ext_platform_device->dev);
+
+	err = wmi_driver_register(&acer_wmi_ext_driver);
+	if (err)
+		goto error_wmi_register;
+
+	err = misc_register(&acer_misc_device);
+	if (err) {
+		pr_err("Unable to register misc device\n");
+		goto error_misc_register;
+	}
 
-	pr_info("Acer WMI extension driver initialized\n");
-	return wmi_driver_register(&acer_wmi_ext_driver);
+	acer_hotkey_init();
+	acer_init_phase_end(ACER_INIT_REGISTER, 0);
+
+	load_time_us = ktime_us_delta(ktime_get(), acer_load_start);
+	pr_info("Acer WMI extension driver initialized in %u us (firmware probes: %llu us)\n",
+		load_time_us,
+		div_u64(acer_init_phases[ACER_INIT_PROBES].duration_ns,
+			NSEC_PER_USEC));
+	return 0;
 
+error_misc_register:
+	wmi_driver_unregister(&acer_wmi_ext_driver);
+error_wmi_register:
+	acer_sysfs_notify_exit();
+	platform_device_unregister(acer_ext_platform_device);
+	platform_driver_unregister(&acer_ext_platform_driver);
+	goto error_cmd;
 error_device_add:
 	platform_device_put(acer_ext_platform_device);
 error_device_alloc:
 	platform_driver_unregister(&acer_ext_platform_driver);
-error_platform_register:
-	wmi_driver_unregister(&acer_wmi_ext_driver);
+error_cmd:
+	acer_calib_exit();
+	acer_cmd_exit();
+	acer_cache_exit();
+error_debugfs:
+	acer_debugfs_exit();
+	acer_genl_exit();
+	acer_state_page_exit();
 	return err;
 }
 
 static void __exit acer_wmi_ext_exit(void)
 {
+	acer_hotkey_exit();
+	misc_deregister(&acer_misc_device);
+	wmi_driver_unregister(&acer_wmi_ext_driver);
 	platform_device_unregister(acer_ext_platform_device);
 	platform_driver_unregister(&acer_ext_platform_driver);
-	wmi_driver_unregister(&acer_wmi_ext_driver);
+	acer_calib_exit();
+	acer_cmd_exit();
+	acer_cache_exit();
+	acer_sysfs_notify_exit();
+	acer_debugfs_exit();
+	acer_genl_exit();
+	acer_state_page_exit();
 }
 
 module_init(acer_wmi_ext_init);
 module_exit(acer_wmi_ext_exit);
+
+#ifdef ACER_WMI_EXT_KUNIT
+#include "acer-wmi-ext-test.c"
+#endif